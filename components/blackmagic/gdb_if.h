@@ -21,9 +21,33 @@
 #ifndef __GDB_IF_H
 #define __GDB_IF_H
 
+#include <stddef.h>
+
 int gdb_if_init(void);
 unsigned char gdb_if_getchar(void);
 unsigned char gdb_if_getchar_to(int timeout);
 void gdb_if_putchar(unsigned char c, int flush);
 
+/* Queue `len` bytes behind anything already written with gdb_if_putchar().
+ * Buffers that do not fit in the transmit buffer are handed to the network
+ * stack in one call together with the pending bytes.
+ */
+void gdb_if_write(const void *buf, size_t len, int flush);
+
+/* Frame, checksum and send a complete reply, waiting for the ack unless
+ * no-ack mode is active. `packet` must not contain characters that need
+ * escaping, which holds for hex-encoded replies.
+ */
+void gdb_if_putpacket(const char *packet, size_t len);
+
+/* As gdb_if_putpacket(), for a reply made of a plain text header followed
+ * by raw binary data. The data is escaped as it is framed.
+ */
+void gdb_if_putpacket_binary(const char *hdr, size_t hdr_len, const void *data, size_t len);
+
+/* As gdb_if_putpacket(), for an asynchronous notification such as
+ * "Stop:T05". It is framed with '%' and isn't acked.
+ */
+void gdb_if_putnotification(const char *packet, size_t len);
+
 #endif
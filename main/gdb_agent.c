@@ -0,0 +1,585 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gdb_main_farpatch.h"
+#include "general.h"
+#include "hex_utils.h"
+#include "target.h"
+
+/* Interpreter for GDB agent expressions, the bytecode GDB sends for
+ * breakpoint conditions, breakpoint commands and tracepoint actions.
+ * Integer operations, registers, memory references, printf and the trace
+ * opcodes are supported. Floating point and trace state variables are not,
+ * and make the evaluation fail.
+ *
+ * Registers and memory are read through the caches, so a condition that
+ * looks at the same data twice only costs one read.
+ */
+
+#define GDB_AGENT_STACK_DEPTH 32
+#define GDB_AGENT_MAX_OPS     10000
+#define GDB_AGENT_PRINTF_SIZE 256
+#define GDB_AGENT_STRING_MAX  128
+
+enum gdb_agent_op {
+	GDB_AGENT_ADD = 0x02,
+	GDB_AGENT_SUB = 0x03,
+	GDB_AGENT_MUL = 0x04,
+	GDB_AGENT_DIV_SIGNED = 0x05,
+	GDB_AGENT_DIV_UNSIGNED = 0x06,
+	GDB_AGENT_REM_SIGNED = 0x07,
+	GDB_AGENT_REM_UNSIGNED = 0x08,
+	GDB_AGENT_LSH = 0x09,
+	GDB_AGENT_RSH_SIGNED = 0x0a,
+	GDB_AGENT_RSH_UNSIGNED = 0x0b,
+	GDB_AGENT_TRACE = 0x0c,
+	GDB_AGENT_TRACE_QUICK = 0x0d,
+	GDB_AGENT_LOG_NOT = 0x0e,
+	GDB_AGENT_BIT_AND = 0x0f,
+	GDB_AGENT_BIT_OR = 0x10,
+	GDB_AGENT_BIT_XOR = 0x11,
+	GDB_AGENT_BIT_NOT = 0x12,
+	GDB_AGENT_EQUAL = 0x13,
+	GDB_AGENT_LESS_SIGNED = 0x14,
+	GDB_AGENT_LESS_UNSIGNED = 0x15,
+	GDB_AGENT_EXT = 0x16,
+	GDB_AGENT_REF8 = 0x17,
+	GDB_AGENT_REF16 = 0x18,
+	GDB_AGENT_REF32 = 0x19,
+	GDB_AGENT_REF64 = 0x1a,
+	GDB_AGENT_IF_GOTO = 0x20,
+	GDB_AGENT_GOTO = 0x21,
+	GDB_AGENT_CONST8 = 0x22,
+	GDB_AGENT_CONST16 = 0x23,
+	GDB_AGENT_CONST32 = 0x24,
+	GDB_AGENT_CONST64 = 0x25,
+	GDB_AGENT_REG = 0x26,
+	GDB_AGENT_END = 0x27,
+	GDB_AGENT_DUP = 0x28,
+	GDB_AGENT_POP = 0x29,
+	GDB_AGENT_ZERO_EXT = 0x2a,
+	GDB_AGENT_SWAP = 0x2b,
+	GDB_AGENT_TRACENZ = 0x2f,
+	GDB_AGENT_TRACE16 = 0x30,
+	GDB_AGENT_PICK = 0x32,
+	GDB_AGENT_ROT = 0x33,
+	GDB_AGENT_PRINTF = 0x34,
+};
+
+const char *gdb_agent_parse(const char *p, uint8_t *code, size_t max, size_t *len)
+{
+	char *end;
+	if (*p != 'X') {
+		return NULL;
+	}
+	unsigned long count = strtoul(p + 1, &end, 16);
+	if (*end != ',' || count == 0 || count > max || strnlen(end + 1, count * 2U) < count * 2U) {
+		return NULL;
+	}
+	unhexify(code, end + 1, count);
+	*len = count;
+	return end + 1 + count * 2U;
+}
+
+/* Fetch an operand of `size` bytes, stored big-endian after the opcode */
+static bool gdb_agent_operand(const uint8_t *code, size_t len, size_t *pc, size_t size, uint64_t *value)
+{
+	if (*pc + size > len) {
+		return false;
+	}
+	*value = 0;
+	for (size_t i = 0; i < size; i++) {
+		*value = (*value << 8) | code[(*pc)++];
+	}
+	return true;
+}
+
+/* Read `size` bytes of little-endian target memory */
+static bool gdb_agent_ref(target_s *t, uint64_t addr, size_t size, uint64_t *value)
+{
+	uint8_t data[8];
+	if (gdb_memcache_read(t, data, addr, size)) {
+		return false;
+	}
+	*value = 0;
+	for (size_t i = size; i > 0; i--) {
+		*value = (*value << 8) | data[i - 1U];
+	}
+	return true;
+}
+
+/* Read a NUL-terminated string of at most `max` bytes from the target */
+static void gdb_agent_string(target_s *t, uint64_t addr, char *str, size_t max)
+{
+	size_t i;
+	for (i = 0; i + 1U < max; i++) {
+		if (gdb_memcache_read(t, str + i, addr + i, 1) || str[i] == '\0') {
+			break;
+		}
+	}
+	str[i] = '\0';
+}
+
+/* Format a 64-bit value as two 32-bit halves, as newlib's nano printf has
+ * no long long support. Flags, width and precision aren't applied.
+ */
+static int gdb_agent_format_64(char *out, size_t size, char conversion, uint64_t value, bool negative)
+{
+	const uint32_t high = value >> 32;
+	const uint32_t low = (uint32_t)value;
+	const char *sign = negative ? "-" : "";
+
+	switch (conversion) {
+	case 'x':
+		return high ? snprintf(out, size, "%" PRIx32 "%08" PRIx32, high, low) : snprintf(out, size, "%" PRIx32, low);
+	case 'X':
+		return high ? snprintf(out, size, "%" PRIX32 "%08" PRIX32, high, low) : snprintf(out, size, "%" PRIX32, low);
+	case 'o': {
+		// Octal digits don't line up with 32 bits, so take them 3 bits at a time
+		char digits[23];
+		size_t n = 0;
+		do {
+			digits[n++] = '0' + (value & 7U);
+			value >>= 3;
+		} while (value);
+		size_t len = 0;
+		while (n && len + 1U < size) {
+			out[len++] = digits[--n];
+		}
+		if (size) {
+			out[len] = '\0';
+		}
+		return len;
+	}
+	default:
+		// Decimal: split at 10^9 so that each part fits in 32 bits
+		if (value >= 1000000000000000000ULL) {
+			return snprintf(out, size, "%s%" PRIu32 "%09" PRIu32 "%09" PRIu32, sign,
+				(uint32_t)(value / 1000000000000000000ULL), (uint32_t)(value / 1000000000U % 1000000000U),
+				(uint32_t)(value % 1000000000U));
+		}
+		if (value >= 1000000000U) {
+			return snprintf(out, size, "%s%" PRIu32 "%09" PRIu32, sign, (uint32_t)(value / 1000000000U),
+				(uint32_t)(value % 1000000000U));
+		}
+		return snprintf(out, size, "%s%" PRIu32, sign, (uint32_t)value);
+	}
+}
+
+/* Format one conversion. `spec` holds the flags, width and precision
+ * followed by the conversion character, without any length modifier.
+ */
+static int gdb_agent_format_arg(
+	const struct gdb_agent_ctx *ctx, char *out, size_t size, char *spec, size_t spec_len, int bits, uint64_t arg)
+{
+	const char conversion = spec[spec_len - 1U];
+	char str[GDB_AGENT_STRING_MAX];
+	char fmt[24];
+
+	switch (conversion) {
+	case 'd':
+	case 'i': {
+		const int64_t value = (int64_t)(arg << (64 - bits)) >> (64 - bits);
+		if (bits == 64) {
+			return gdb_agent_format_64(out, size, 'u', value < 0 ? -(uint64_t)value : (uint64_t)value, value < 0);
+		}
+		spec[spec_len - 1U] = '\0';
+		snprintf(fmt, sizeof(fmt), "%s%s", spec, PRId32);
+		return snprintf(out, size, fmt, (int32_t)value);
+	}
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X': {
+		if (bits == 64) {
+			return gdb_agent_format_64(out, size, conversion, arg, false);
+		}
+		const uint32_t value = (uint32_t)arg & (uint32_t)((1ULL << bits) - 1U);
+		spec[spec_len - 1U] = '\0';
+		snprintf(fmt, sizeof(fmt), "%s%s", spec,
+			conversion == 'u' ? PRIu32 : conversion == 'o' ? PRIo32 : conversion == 'x' ? PRIx32 : PRIX32);
+		return snprintf(out, size, fmt, value);
+	}
+	case 'p':
+		return snprintf(out, size, "0x%" PRIx32, (uint32_t)arg);
+	case 'c':
+		return snprintf(out, size, spec, (int)(uint8_t)arg);
+	case 's':
+		gdb_agent_string(ctx->t, arg, str, sizeof(str));
+		return snprintf(out, size, spec, str);
+	default:
+		return -1;
+	}
+}
+
+/* Expand the C escape at `*p`, which follows a backslash. GDB sends the
+ * format string as it was typed, and leaves this to the agent. Returns -1
+ * for an escape GDB wouldn't accept either.
+ */
+static int gdb_agent_escape(const char **p)
+{
+	const char c = *(*p)++;
+	if (c >= '0' && c <= '7') {
+		int value = c - '0';
+		for (int i = 0; i < 2 && **p >= '0' && **p <= '7'; i++) {
+			value = value * 8 + *(*p)++ - '0';
+		}
+		return value & 0xff;
+	}
+	switch (c) {
+	case 'n':
+		return '\n';
+	case 't':
+		return '\t';
+	case 'r':
+		return '\r';
+	case 'a':
+		return '\a';
+	case 'b':
+		return '\b';
+	case 'f':
+		return '\f';
+	case 'v':
+		return '\v';
+	case '\\':
+	case '"':
+	case '\'':
+		return c;
+	default:
+		return -1;
+	}
+}
+
+/* printf for dprintf. `args[0]` is the first argument. */
+static bool gdb_agent_printf(const struct gdb_agent_ctx *ctx, const char *format, const uint64_t *args, size_t nargs)
+{
+	char out[GDB_AGENT_PRINTF_SIZE];
+	size_t len = 0;
+	size_t arg = 0;
+
+	for (const char *p = format; *p && len + 1U < sizeof(out);) {
+		if (*p == '\\') {
+			p++;
+			const int c = gdb_agent_escape(&p);
+			if (c < 0) {
+				return false;
+			}
+			out[len++] = (char)c;
+			continue;
+		}
+		if (*p != '%') {
+			out[len++] = *p++;
+			continue;
+		}
+		if (p[1] == '%') {
+			out[len++] = '%';
+			p += 2;
+			continue;
+		}
+
+		// Flags, width and precision are kept; the length modifier picks the size
+		char spec[16];
+		size_t spec_len = 0;
+		spec[spec_len++] = *p++;
+		while (*p && strchr("-+ #0123456789.", *p) && spec_len < sizeof(spec) - 2U) {
+			spec[spec_len++] = *p++;
+		}
+		int bits = 32;
+		if (p[0] == 'h') {
+			bits = p[1] == 'h' ? 8 : 16;
+			p += p[1] == 'h' ? 2 : 1;
+		} else if (p[0] == 'l' && p[1] == 'l') {
+			bits = 64;
+			p += 2;
+		} else if (*p == 'j') {
+			bits = 64;
+			p++;
+		} else if (*p == 'l' || *p == 'z' || *p == 't') {
+			p++;
+		}
+		if (!*p || arg == nargs) {
+			return false;
+		}
+		spec[spec_len++] = *p++;
+		spec[spec_len] = '\0';
+
+		const int written = gdb_agent_format_arg(ctx, out + len, sizeof(out) - len, spec, spec_len, bits, args[arg++]);
+		if (written < 0) {
+			return false;
+		}
+		len += (size_t)written;
+		if (len >= sizeof(out)) {
+			len = sizeof(out) - 1U;
+		}
+	}
+	out[len] = '\0';
+	ctx->output(ctx->arg, out);
+	return true;
+}
+
+bool gdb_agent_eval(const struct gdb_agent_ctx *ctx, const uint8_t *code, size_t len, uint64_t *result)
+{
+	uint64_t stack[GDB_AGENT_STACK_DEPTH];
+	size_t sp = 0;
+	size_t pc = 0;
+	uint64_t operand;
+
+#define NEED(n)                                                                                                        \
+	do {                                                                                                               \
+		if (sp < (n))                                                                                                  \
+			return false;                                                                                              \
+	} while (0)
+#define PUSH(v)                                                                                                        \
+	do {                                                                                                               \
+		const uint64_t pushed = (v);                                                                                   \
+		if (sp == GDB_AGENT_STACK_DEPTH)                                                                               \
+			return false;                                                                                              \
+		stack[sp++] = pushed;                                                                                          \
+	} while (0)
+#define TOP  stack[sp - 1U]
+#define NEXT stack[sp - 2U]
+
+	for (uint32_t ops = 0; ops < GDB_AGENT_MAX_OPS && pc < len; ops++) {
+		const uint8_t op = code[pc++];
+		switch (op) {
+		case GDB_AGENT_ADD:
+			NEED(2);
+			NEXT += TOP;
+			sp--;
+			break;
+		case GDB_AGENT_SUB:
+			NEED(2);
+			NEXT -= TOP;
+			sp--;
+			break;
+		case GDB_AGENT_MUL:
+			NEED(2);
+			NEXT *= TOP;
+			sp--;
+			break;
+		case GDB_AGENT_DIV_SIGNED:
+		case GDB_AGENT_REM_SIGNED:
+			NEED(2);
+			if (!TOP) {
+				return false;
+			}
+			NEXT = op == GDB_AGENT_DIV_SIGNED ? (uint64_t)((int64_t)NEXT / (int64_t)TOP) :
+												(uint64_t)((int64_t)NEXT % (int64_t)TOP);
+			sp--;
+			break;
+		case GDB_AGENT_DIV_UNSIGNED:
+		case GDB_AGENT_REM_UNSIGNED:
+			NEED(2);
+			if (!TOP) {
+				return false;
+			}
+			NEXT = op == GDB_AGENT_DIV_UNSIGNED ? NEXT / TOP : NEXT % TOP;
+			sp--;
+			break;
+		case GDB_AGENT_LSH:
+			NEED(2);
+			NEXT = TOP < 64 ? NEXT << TOP : 0;
+			sp--;
+			break;
+		case GDB_AGENT_RSH_SIGNED:
+			NEED(2);
+			NEXT = (uint64_t)((int64_t)NEXT >> (TOP < 64 ? TOP : 63));
+			sp--;
+			break;
+		case GDB_AGENT_RSH_UNSIGNED:
+			NEED(2);
+			NEXT = TOP < 64 ? NEXT >> TOP : 0;
+			sp--;
+			break;
+		case GDB_AGENT_LOG_NOT:
+			NEED(1);
+			TOP = !TOP;
+			break;
+		case GDB_AGENT_BIT_AND:
+			NEED(2);
+			NEXT &= TOP;
+			sp--;
+			break;
+		case GDB_AGENT_BIT_OR:
+			NEED(2);
+			NEXT |= TOP;
+			sp--;
+			break;
+		case GDB_AGENT_BIT_XOR:
+			NEED(2);
+			NEXT ^= TOP;
+			sp--;
+			break;
+		case GDB_AGENT_BIT_NOT:
+			NEED(1);
+			TOP = ~TOP;
+			break;
+		case GDB_AGENT_EQUAL:
+			NEED(2);
+			NEXT = NEXT == TOP;
+			sp--;
+			break;
+		case GDB_AGENT_LESS_SIGNED:
+			NEED(2);
+			NEXT = (int64_t)NEXT < (int64_t)TOP;
+			sp--;
+			break;
+		case GDB_AGENT_LESS_UNSIGNED:
+			NEED(2);
+			NEXT = NEXT < TOP;
+			sp--;
+			break;
+		case GDB_AGENT_EXT:
+		case GDB_AGENT_ZERO_EXT:
+			NEED(1);
+			if (!gdb_agent_operand(code, len, &pc, 1, &operand)) {
+				return false;
+			}
+			if (operand > 0 && operand < 64) {
+				const uint64_t mask = (1ULL << operand) - 1U;
+				const uint64_t sign = 1ULL << (operand - 1U);
+				TOP &= mask;
+				if (op == GDB_AGENT_EXT && (TOP & sign)) {
+					TOP |= ~mask;
+				}
+			}
+			break;
+		case GDB_AGENT_REF8:
+		case GDB_AGENT_REF16:
+		case GDB_AGENT_REF32:
+		case GDB_AGENT_REF64:
+			NEED(1);
+			if (!gdb_agent_ref(ctx->t, TOP, 1U << (op - GDB_AGENT_REF8), &TOP)) {
+				return false;
+			}
+			break;
+		case GDB_AGENT_IF_GOTO:
+			NEED(1);
+			if (!gdb_agent_operand(code, len, &pc, 2, &operand)) {
+				return false;
+			}
+			if (stack[--sp]) {
+				pc = operand;
+			}
+			break;
+		case GDB_AGENT_GOTO:
+			if (!gdb_agent_operand(code, len, &pc, 2, &operand)) {
+				return false;
+			}
+			pc = operand;
+			break;
+		case GDB_AGENT_CONST8:
+		case GDB_AGENT_CONST16:
+		case GDB_AGENT_CONST32:
+		case GDB_AGENT_CONST64:
+			if (!gdb_agent_operand(code, len, &pc, 1U << (op - GDB_AGENT_CONST8), &operand)) {
+				return false;
+			}
+			PUSH(operand);
+			break;
+		case GDB_AGENT_REG: {
+			uint8_t data[8] = {0};
+			if (!gdb_agent_operand(code, len, &pc, 2, &operand) ||
+				!gdb_regcache_reg_read(ctx->t, operand, data, sizeof(data))) {
+				return false;
+			}
+			uint64_t value = 0;
+			for (size_t i = sizeof(data); i > 0; i--) {
+				value = (value << 8) | data[i - 1U];
+			}
+			PUSH(value);
+			break;
+		}
+		case GDB_AGENT_END:
+			// Commands such as printf leave nothing on the stack
+			*result = sp ? TOP : 0;
+			return true;
+		case GDB_AGENT_DUP:
+			NEED(1);
+			PUSH(TOP);
+			break;
+		case GDB_AGENT_POP:
+			NEED(1);
+			sp--;
+			break;
+		case GDB_AGENT_SWAP: {
+			NEED(2);
+			const uint64_t tmp = TOP;
+			TOP = NEXT;
+			NEXT = tmp;
+			break;
+		}
+		case GDB_AGENT_PICK:
+			if (!gdb_agent_operand(code, len, &pc, 1, &operand)) {
+				return false;
+			}
+			NEED(operand + 1U);
+			PUSH(stack[sp - 1U - operand]);
+			break;
+		case GDB_AGENT_ROT: {
+			// a b c -> c a b
+			NEED(3);
+			const uint64_t c = TOP;
+			TOP = NEXT;
+			NEXT = stack[sp - 3U];
+			stack[sp - 3U] = c;
+			break;
+		}
+		case GDB_AGENT_TRACE:
+		case GDB_AGENT_TRACENZ:
+			// addr size ->
+			NEED(2);
+			if (ctx->collect && !ctx->collect(ctx->arg, NEXT, TOP)) {
+				return false;
+			}
+			sp -= 2U;
+			break;
+		case GDB_AGENT_TRACE_QUICK:
+		case GDB_AGENT_TRACE16:
+			// addr -> addr
+			NEED(1);
+			if (!gdb_agent_operand(code, len, &pc, op == GDB_AGENT_TRACE16 ? 2 : 1, &operand)) {
+				return false;
+			}
+			if (ctx->collect && !ctx->collect(ctx->arg, TOP, operand)) {
+				return false;
+			}
+			break;
+		case GDB_AGENT_PRINTF: {
+			// args... channel function -> , then nargs, a string length and the format
+			uint64_t nargs;
+			uint64_t format_len;
+			if (!ctx->output || !gdb_agent_operand(code, len, &pc, 1, &nargs) ||
+				!gdb_agent_operand(code, len, &pc, 2, &format_len) || !format_len || pc + format_len > len ||
+				code[pc + format_len - 1U] != '\0') {
+				return false;
+			}
+			const char *format = (const char *)code + pc;
+			pc += format_len;
+			NEED(nargs + 2U);
+			sp -= 2U;
+			// The arguments were pushed last first
+			uint64_t args[GDB_AGENT_STACK_DEPTH];
+			for (size_t i = 0; i < nargs; i++) {
+				args[i] = stack[sp - 1U - i];
+			}
+			sp -= nargs;
+			if (!gdb_agent_printf(ctx, format, args, nargs)) {
+				return false;
+			}
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+
+#undef NEED
+#undef PUSH
+#undef TOP
+#undef NEXT
+
+	return false;
+}
@@ -0,0 +1,420 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "gdb_main_farpatch.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "target.h"
+#include "uart.h"
+
+#define TAG "gdb_breakpoint"
+
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+
+/* Breakpoints with conditions and commands evaluated on the probe. GDB
+ * sends both as agent expressions with Z0 and Z1, and may send the same
+ * breakpoint again with new ones without removing it first, so every
+ * breakpoint inserted through here is tracked.
+ *
+ * Commands come from `dprintf` with `set dprintf-style agent`. When the
+ * conditions hold, the commands run and the target carries on; GDB only
+ * sees the output.
+ */
+
+#define GDB_BREAKPOINT_SLOTS      16
+#define GDB_BREAKPOINT_MAX_EXPRS  4
+#define GDB_BREAKPOINT_CODE_SIZE  256
+
+struct gdb_breakpoint {
+	bool used;
+	bool hardware;
+	uint32_t addr;
+	uint32_t kind;
+	uint8_t conditions;
+	uint8_t commands;
+	/* Conditions and then commands are stored back to back, each ending at
+	 * `expr_end[i]`
+	 */
+	uint16_t expr_end[GDB_BREAKPOINT_MAX_EXPRS];
+	uint8_t code[GDB_BREAKPOINT_CODE_SIZE];
+};
+
+uint32_t gdb_breakpoint_hits;
+uint32_t gdb_breakpoint_reports;
+uint32_t gdb_breakpoint_printfs;
+
+static target_s *gdb_breakpoint_target;
+static struct gdb_breakpoint gdb_breakpoints[GDB_BREAKPOINT_SLOTS];
+
+void gdb_breakpoint_clear(void)
+{
+	memset(gdb_breakpoints, 0, sizeof(gdb_breakpoints));
+	gdb_breakpoint_target = NULL;
+}
+
+static struct gdb_breakpoint *gdb_breakpoint_find(target_s *t, uint32_t addr, bool hardware)
+{
+	if (t != gdb_breakpoint_target) {
+		gdb_breakpoint_clear();
+		gdb_breakpoint_target = t;
+	}
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_breakpoints); i++) {
+		struct gdb_breakpoint *bp = &gdb_breakpoints[i];
+		if (bp->used && bp->addr == addr && bp->hardware == hardware) {
+			return bp;
+		}
+	}
+	return NULL;
+}
+
+static struct gdb_breakpoint *gdb_breakpoint_alloc(void)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_breakpoints); i++) {
+		if (!gdb_breakpoints[i].used) {
+			return &gdb_breakpoints[i];
+		}
+	}
+	return NULL;
+}
+
+static bool gdb_breakpoint_conditional(target_s *t)
+{
+	if (t != gdb_breakpoint_target) {
+		return false;
+	}
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_breakpoints); i++) {
+		if (gdb_breakpoints[i].used && (gdb_breakpoints[i].conditions || gdb_breakpoints[i].commands)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Parse a run of 'X<len>,<bytecode>' expressions, counting them in `count` */
+static const char *gdb_breakpoint_parse_exprs(const char *p, struct gdb_breakpoint *bp, size_t *used, uint8_t *count)
+{
+	while (*p == 'X' || (p[0] == ';' && p[1] == 'X')) {
+		size_t len;
+		if (bp->conditions + bp->commands == GDB_BREAKPOINT_MAX_EXPRS) {
+			return NULL;
+		}
+		p = gdb_agent_parse(p + (*p == ';'), bp->code + *used, sizeof(bp->code) - *used, &len);
+		if (!p) {
+			return NULL;
+		}
+		*used += len;
+		bp->expr_end[bp->conditions + bp->commands] = *used;
+		(*count)++;
+	}
+	return p;
+}
+
+/* Parse the ';X...' conditions and ';cmds:persist,X...' commands that
+ * follow a Z packet
+ */
+static bool gdb_breakpoint_parse_conditions(const char *p, struct gdb_breakpoint *bp)
+{
+	size_t used = 0;
+	bp->conditions = 0;
+	bp->commands = 0;
+	p = gdb_breakpoint_parse_exprs(p, bp, &used, &bp->conditions);
+	if (p && !strncmp(p, ";cmds:", 6)) {
+		// Whether the commands persist after GDB disconnects doesn't matter here
+		p = strchr(p + 6, ',');
+		p = p ? gdb_breakpoint_parse_exprs(p + 1, bp, &used, &bp->commands) : NULL;
+	}
+	return p && *p == '\0';
+}
+
+static target_breakwatch_e gdb_breakpoint_type(const struct gdb_breakpoint *bp)
+{
+	return bp->hardware ? TARGET_BREAK_HARD : TARGET_BREAK_SOFT;
+}
+
+/* 'Z0,addr,kind[;cond...]' and 'Z1,...' */
+bool gdb_breakpoint_insert(target_s *t, const char *pbuf)
+{
+	uint32_t addr;
+	uint32_t kind;
+	int args_end = 0;
+	if ((pbuf[1] != '0' && pbuf[1] != '1') ||
+		sscanf(pbuf + 2, ",%" SCNx32 ",%" SCNx32 "%n", &addr, &kind, &args_end) != 2) {
+		return false;
+	}
+	const char *conditions = pbuf + 2 + args_end;
+	const bool hardware = pbuf[1] == '1';
+
+	struct gdb_breakpoint parsed = {
+		.used = true,
+		.hardware = hardware,
+		.addr = addr,
+		.kind = kind,
+	};
+	if (!gdb_breakpoint_parse_conditions(conditions, &parsed)) {
+		gdb_putpacketz("E01");
+		return true;
+	}
+
+	// Already inserted, so only the conditions change
+	struct gdb_breakpoint *bp = gdb_breakpoint_find(t, addr, hardware);
+	if (bp) {
+		*bp = parsed;
+		gdb_putpacketz("OK");
+		return true;
+	}
+
+	bp = gdb_breakpoint_alloc();
+	if (!bp) {
+		if (parsed.conditions || parsed.commands) {
+			ESP_LOGW(TAG, "no room for a conditional breakpoint at 0x%08" PRIx32, addr);
+			gdb_putpacketz("E01");
+			return true;
+		}
+		return false;
+	}
+	if (target_breakwatch_set(t, gdb_breakpoint_type(&parsed), addr, kind) != 0) {
+		gdb_putpacketz("E01");
+		return true;
+	}
+	*bp = parsed;
+	gdb_putpacketz("OK");
+	return true;
+}
+
+/* 'z0,addr,kind' and 'z1,...' */
+bool gdb_breakpoint_remove(target_s *t, const char *pbuf)
+{
+	uint32_t addr;
+	uint32_t kind;
+	if ((pbuf[1] != '0' && pbuf[1] != '1') || sscanf(pbuf + 2, ",%" SCNx32 ",%" SCNx32, &addr, &kind) != 2) {
+		return false;
+	}
+	struct gdb_breakpoint *bp = gdb_breakpoint_find(t, addr, pbuf[1] == '1');
+	if (!bp) {
+		return false;
+	}
+	bp->used = false;
+	if (target_breakwatch_clear(t, gdb_breakpoint_type(bp), bp->addr, bp->kind) != 0) {
+		gdb_putpacketz("E01");
+	} else {
+		gdb_putpacketz("OK");
+	}
+	return true;
+}
+
+/* Whether the breakpoint applies to this hit. It does if it has no
+ * conditions, or any of them is true or can't be evaluated.
+ */
+static bool gdb_breakpoint_condition_true(target_s *t, const struct gdb_breakpoint *bp)
+{
+	const struct gdb_agent_ctx ctx = {.t = t};
+	size_t start = 0;
+	if (!bp->conditions) {
+		return true;
+	}
+	for (size_t i = 0; i < bp->conditions; i++) {
+		uint64_t result;
+		if (!gdb_agent_eval(&ctx, bp->code + start, bp->expr_end[i] - start, &result) || result) {
+			return true;
+		}
+		start = bp->expr_end[i];
+	}
+	return false;
+}
+
+/* GDB doesn't accept console output in non-stop mode */
+static bool gdb_breakpoint_non_stop(void)
+{
+	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
+	const struct bmp_wifi_instance *instance = ptr ? ptr[0] : NULL;
+	return instance && instance->non_stop;
+}
+
+/* dprintf output goes to the GDB console, except in non-stop mode, and the
+ * debug websocket
+ */
+static void gdb_breakpoint_output(void *arg, const char *text)
+{
+	(void)arg;
+	if (!gdb_breakpoint_non_stop()) {
+		gdb_out(text);
+	}
+#ifdef CONFIG_DEBUG_UART
+	for (const char *p = text; *p; p++) {
+		if (*p == '\n') {
+			debug_putc('\r', 0);
+		}
+		debug_putc(*p, *p == '\n');
+	}
+#endif
+}
+
+/* Run the commands. Returns `false` if one of them fails, and GDB should
+ * then be told about the hit.
+ */
+static bool gdb_breakpoint_run_commands(target_s *t, const struct gdb_breakpoint *bp)
+{
+#ifndef CONFIG_DEBUG_UART
+	// Without the websocket there is nowhere for the output to go, so GDB
+	// gets the stop and runs the commands itself
+	if (gdb_breakpoint_non_stop()) {
+		return false;
+	}
+#endif
+	const struct gdb_agent_ctx ctx = {.t = t, .output = gdb_breakpoint_output};
+	size_t start = bp->conditions ? bp->expr_end[bp->conditions - 1U] : 0;
+	for (size_t i = bp->conditions; i < bp->conditions + bp->commands; i++) {
+		uint64_t result;
+		if (!gdb_agent_eval(&ctx, bp->code + start, bp->expr_end[i] - start, &result)) {
+			return false;
+		}
+		start = bp->expr_end[i];
+	}
+	gdb_breakpoint_printfs++;
+	return true;
+}
+
+/* Check GDB's breakpoints at `pc`, running the commands of those that
+ * apply. Returns -1 if there are none, 0 if the target can carry on, or 1
+ * if GDB should be told.
+ */
+static int gdb_breakpoint_check(target_s *t, uint32_t pc)
+{
+	int verdict = -1;
+	if (t != gdb_breakpoint_target) {
+		return verdict;
+	}
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_breakpoints) && verdict < 1; i++) {
+		const struct gdb_breakpoint *bp = &gdb_breakpoints[i];
+		if (!bp->used || bp->addr != pc) {
+			continue;
+		}
+		if (!bp->conditions && !bp->commands) {
+			verdict = 1;
+			continue;
+		}
+		gdb_breakpoint_hits++;
+		if (!gdb_breakpoint_condition_true(t, bp)) {
+			verdict = 0;
+		} else if (bp->commands) {
+			verdict = gdb_breakpoint_run_commands(t, bp) ? 0 : 1;
+		} else {
+			verdict = 1;
+		}
+	}
+	if (verdict == 1) {
+		gdb_breakpoint_reports++;
+	}
+	return verdict;
+}
+
+/* Take GDB's breakpoints at `pc` out of the target, or put them back */
+static void gdb_breakpoint_lift(target_s *t, uint32_t pc, bool lifted)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_breakpoints); i++) {
+		const struct gdb_breakpoint *bp = &gdb_breakpoints[i];
+		if (!bp->used || bp->addr != pc) {
+			continue;
+		}
+		if (lifted) {
+			target_breakwatch_clear(t, gdb_breakpoint_type(bp), bp->addr, bp->kind);
+		} else {
+			target_breakwatch_set(t, gdb_breakpoint_type(bp), bp->addr, bp->kind);
+		}
+	}
+}
+
+#endif /* CONFIG_GDB_CONDITIONAL_BREAKPOINTS */
+
+/* Stops the probe deals with itself. While a conditional breakpoint or a
+ * tracepoint is set, or threads are known, the target is polled here rather
+ * than by gdb_poll_target(). A breakpoint hit whose conditions are all false, or
+ * that only a tracepoint wanted, steps over the breakpoint and resumes at
+ * once, without a round trip to GDB.
+ */
+
+bool gdb_breakpoint_active(target_s *t)
+{
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+	if (gdb_breakpoint_conditional(t)) {
+		return true;
+	}
+#endif
+#if CONFIG_GDB_TRACEPOINTS
+	if (gdb_trace_active(t)) {
+		return true;
+	}
+#endif
+#if CONFIG_GDB_RTOS_THREADS
+	// For the thread in the stop reply
+	if (gdb_rtos_active(t)) {
+		return true;
+	}
+#endif
+	(void)t;
+	return false;
+}
+
+/* Whether the target should carry on from the breakpoint at `pc` */
+static bool gdb_breakpoint_pass(target_s *t, uint32_t pc)
+{
+	bool traced = false;
+	int verdict = -1;
+#if CONFIG_GDB_TRACEPOINTS
+	traced = gdb_trace_hit(t, pc);
+#endif
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+	verdict = gdb_breakpoint_check(t, pc);
+#endif
+	return verdict == 0 || (verdict < 0 && traced);
+}
+
+/* Step off the breakpoints at `pc`. Returns why the step stopped. */
+static target_halt_reason_e gdb_breakpoint_step_over(target_s *t, uint32_t pc, target_addr_t *watch)
+{
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+	gdb_breakpoint_lift(t, pc, true);
+#endif
+#if CONFIG_GDB_TRACEPOINTS
+	gdb_trace_lift(t, pc, true);
+#endif
+	target_halt_reason_e reason = gdb_step_once(t, watch);
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+	gdb_breakpoint_lift(t, pc, false);
+#endif
+#if CONFIG_GDB_TRACEPOINTS
+	gdb_trace_lift(t, pc, false);
+#endif
+	return reason;
+}
+
+bool gdb_breakpoint_poll(target_s *t)
+{
+	target_addr_t watch = 0;
+	target_halt_reason_e reason = target_halt_poll(t, &watch);
+	if (reason == TARGET_HALT_RUNNING) {
+		return true;
+	}
+
+	// Halted, so the caches may be used while conditions are evaluated
+	gdb_target_running = false;
+	const int pc_reg = gdb_regcache_pc_reg(t);
+	uint32_t pc = 0;
+	if (reason == TARGET_HALT_BREAKPOINT && pc_reg >= 0 &&
+		gdb_regcache_reg_read(t, pc_reg, &pc, sizeof(pc)) == sizeof(pc) && gdb_breakpoint_pass(t, pc)) {
+		reason = gdb_breakpoint_step_over(t, pc, &watch);
+		if (reason == TARGET_HALT_STEPPING) {
+			gdb_memcache_invalidate();
+			gdb_regcache_invalidate();
+			target_halt_resume(t, false);
+			gdb_target_running = true;
+			return true;
+		}
+	}
+
+	gdb_stop_reply(t, reason, watch);
+	return false;
+}
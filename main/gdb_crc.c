@@ -0,0 +1,252 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "crc32.h"
+#include "gdb_main_farpatch.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "target.h"
+
+#if CONFIG_GDB_CRC_STUB
+
+/* CRC of target memory computed by the target itself. blackmagic answers
+ * qCRC by reading the whole range back over SWD, which for `compare-sections`
+ * on a large image takes far longer than the CPU next to the memory needs.
+ * On Cortex-M the routine below is copied to the start or the end of RAM,
+ * whichever the range being checked leaves alone, and run with interrupts
+ * masked. The RAM and registers it uses are restored afterwards.
+ * Anything else, or any failure, is left to blackmagic's probe-side CRC.
+ */
+
+#define TAG "gdb_crc"
+
+#define GDB_CRC_MAP_SIZE 1024
+
+/* GDB's CRC-32 (polynomial 0x04c11db7, MSB first, no final inversion) one
+ * bit at a time, in Thumb-1 so that it also runs on ARMv6-M.
+ * r0 = address, r1 = length, r2 = crc, r3 = polynomial; returns r0 = crc.
+ */
+static const uint16_t gdb_crc_stub_code[] = {
+	0x2900, // loop: cmp   r1, #0
+	0xd00b, //       beq   done
+	0x7804, //       ldrb  r4, [r0]
+	0x3001, //       adds  r0, #1
+	0x0624, //       lsls  r4, r4, #24
+	0x4062, //       eors  r2, r4
+	0x2508, //       movs  r5, #8
+	0x0052, // bit:  lsls  r2, r2, #1
+	0xd300, //       bcc   next
+	0x405a, //       eors  r2, r3
+	0x3d01, // next: subs  r5, #1
+	0xd1fa, //       bne   bit
+	0x3901, //       subs  r1, #1
+	0xe7f1, //       b     loop
+	0x4610, // done: mov   r0, r2
+	0xbe00, //       bkpt  #0
+};
+
+#define CORTEXM_REG_PC      15
+#define CORTEXM_REG_XPSR    16
+#define CORTEXM_REG_SPECIAL 19
+#define CORTEXM_XPSR_THUMB  (1U << 24)
+#define CORTEXM_XPSR_ICI_IT 0x0600fc00U
+#define CORTEXM_PRIMASK     (1U << 0)
+
+uint32_t gdb_crc_stub_runs;
+uint32_t gdb_crc_fallbacks;
+
+static target_s *gdb_crc_target;
+static uint32_t gdb_crc_ram_start;
+static uint32_t gdb_crc_ram_length;
+
+/* Find the first RAM region in the target's memory map */
+static bool gdb_crc_find_ram(target_s *t)
+{
+	if (t == gdb_crc_target) {
+		return gdb_crc_ram_length != 0;
+	}
+
+	char *map = malloc(GDB_CRC_MAP_SIZE);
+	if (!map) {
+		return false;
+	}
+	uint32_t ram_start = 0;
+	uint32_t ram_length = 0;
+	if (target_mem_map(t, map, GDB_CRC_MAP_SIZE)) {
+		const char *ram = strstr(map, "<memory type=\"ram\"");
+		const char *start = ram ? strstr(ram, "start=\"") : NULL;
+		const char *length = ram ? strstr(ram, "length=\"") : NULL;
+		if (start && length) {
+			ram_start = strtoul(start + 7, NULL, 0);
+			ram_length = strtoul(length + 8, NULL, 0);
+		}
+	}
+	free(map);
+
+	gdb_crc_target = t;
+	gdb_crc_ram_start = ram_start;
+	gdb_crc_ram_length = ram_length >= sizeof(gdb_crc_stub_code) ? ram_length : 0;
+	return gdb_crc_ram_length != 0;
+}
+
+/* Place the stub at the start of RAM, or at its end if the range being
+ * checked covers the start. Returns 0 if neither is clear of the range.
+ */
+static uint32_t gdb_crc_find_workspace(target_s *t, uint32_t addr, uint32_t len)
+{
+	if (!gdb_crc_find_ram(t)) {
+		return 0;
+	}
+	const uint32_t candidates[] = {
+		gdb_crc_ram_start,
+		(gdb_crc_ram_start + gdb_crc_ram_length - sizeof(gdb_crc_stub_code)) & ~3U,
+	};
+	for (size_t i = 0; i < ARRAY_LENGTH(candidates); i++) {
+		const uint32_t workspace = candidates[i];
+		if ((uint64_t)addr + len <= workspace || addr >= workspace + sizeof(gdb_crc_stub_code)) {
+			return workspace;
+		}
+	}
+	return 0;
+}
+
+/* How long the target may take to halt once the stub has timed out */
+#define GDB_CRC_HALT_TIMEOUT_US 1000000
+
+/* Resume the target and wait for the stub's breakpoint. `lost` is set if
+ * the target won't halt again afterwards.
+ */
+static bool gdb_crc_run(target_s *t, uint32_t len, bool *lost)
+{
+	const int64_t deadline = esp_timer_get_time() + 1000000LL + (int64_t)len * 8;
+	target_addr_t watch;
+
+	target_halt_resume(t, false);
+	for (;;) {
+		target_halt_reason_e reason = target_halt_poll(t, &watch);
+		if (reason == TARGET_HALT_BREAKPOINT) {
+			return true;
+		}
+		if (reason == TARGET_HALT_ERROR) {
+			return false;
+		}
+		if (reason != TARGET_HALT_RUNNING) {
+			ESP_LOGW(TAG, "stub stopped unexpectedly (%d)", reason);
+			return false;
+		}
+		if (esp_timer_get_time() > deadline) {
+			ESP_LOGW(TAG, "stub timed out");
+			const int64_t halt_deadline = esp_timer_get_time() + GDB_CRC_HALT_TIMEOUT_US;
+			target_halt_request(t);
+			while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING &&
+				esp_timer_get_time() < halt_deadline) {
+				vTaskDelay(1);
+			}
+			*lost = reason == TARGET_HALT_RUNNING || reason == TARGET_HALT_ERROR;
+			return false;
+		}
+		vTaskDelay(1);
+	}
+}
+
+bool gdb_crc_stub(target_s *t, uint32_t addr, uint32_t len, uint32_t *crc)
+{
+	const char *core = target_core_name(t);
+	const size_t regs_size = target_regs_size(t);
+	if (gdb_target_running || !core || core[0] != 'M' || regs_size < (CORTEXM_REG_SPECIAL + 1) * 4 ||
+		regs_size > 512) {
+		gdb_crc_fallbacks++;
+		return false;
+	}
+	const uint32_t workspace = gdb_crc_find_workspace(t, addr, len);
+	if (!workspace) {
+		gdb_crc_fallbacks++;
+		return false;
+	}
+
+	uint8_t saved_ram[sizeof(gdb_crc_stub_code)];
+	uint32_t saved_regs[regs_size / 4];
+	uint32_t regs[regs_size / 4];
+	target_regs_read(t, saved_regs);
+	if (target_mem_read(t, saved_ram, workspace, sizeof(saved_ram))) {
+		gdb_crc_fallbacks++;
+		return false;
+	}
+
+	memcpy(regs, saved_regs, regs_size);
+	regs[0] = addr;
+	regs[1] = len;
+	regs[2] = 0xffffffffU;
+	regs[3] = 0x04c11db7U;
+	regs[CORTEXM_REG_PC] = workspace;
+	regs[CORTEXM_REG_XPSR] = (regs[CORTEXM_REG_XPSR] & ~CORTEXM_XPSR_ICI_IT) | CORTEXM_XPSR_THUMB;
+	regs[CORTEXM_REG_SPECIAL] |= CORTEXM_PRIMASK;
+
+	bool ok = !target_mem_write(t, workspace, gdb_crc_stub_code, sizeof(gdb_crc_stub_code));
+	if (ok) {
+		bool lost = false;
+		target_regs_write(t, regs);
+		ok = gdb_crc_run(t, len, &lost);
+		if (lost) {
+			ESP_LOGW(TAG, "target didn't halt after the stub -- freeing it");
+			gdb_crc_fallbacks++;
+			gdb_target_free();
+			return false;
+		}
+		target_regs_read(t, regs);
+		*crc = regs[0];
+		ok = ok && regs[CORTEXM_REG_PC] == workspace + sizeof(gdb_crc_stub_code) - 2U;
+	}
+
+	target_mem_write(t, workspace, saved_ram, sizeof(saved_ram));
+	target_regs_write(t, saved_regs);
+	if (ok) {
+		gdb_crc_stub_runs++;
+	} else {
+		gdb_crc_fallbacks++;
+	}
+	return ok;
+}
+
+/* `monitor crc <addr> <len>`: Time the stub against the probe-side CRC */
+bool gdb_crc_command(int argc, const char **argv)
+{
+	if (argc != 3 || !cur_target) {
+		gdb_out("usage: crc <addr> <len>\n");
+		return false;
+	}
+	const uint32_t addr = strtoul(argv[1], NULL, 0);
+	const uint32_t len = strtoul(argv[2], NULL, 0);
+	uint32_t crc;
+
+	int64_t started_at = esp_timer_get_time();
+	if (gdb_crc_stub(cur_target, addr, len, &crc)) {
+		gdb_outf("Target: 0x%08" PRIx32 " in %" PRIu32 " ms\n", crc,
+			(uint32_t)((esp_timer_get_time() - started_at) / 1000));
+	} else {
+		gdb_out("Target: unavailable\n");
+	}
+
+	if (!cur_target) {
+		gdb_out("Target lost\n");
+		return true;
+	}
+	started_at = esp_timer_get_time();
+	if (generic_crc32(cur_target, &crc, addr, len)) {
+		gdb_outf("Probe: 0x%08" PRIx32 " in %" PRIu32 " ms\n", crc,
+			(uint32_t)((esp_timer_get_time() - started_at) / 1000));
+	} else {
+		gdb_out("Probe: failed\n");
+	}
+	return true;
+}
+
+#endif /* CONFIG_GDB_CRC_STUB */
@@ -0,0 +1,840 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "gdb_if.h"
+#include "gdb_main_farpatch.h"
+#include "gdb_main.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "hex_utils.h"
+#include "target.h"
+
+/* Packets that are answered here rather than in blackmagic's gdb_main().
+ * Replies are built in the packet buffer and handed to gdb_if_putpacket() as a
+ * whole, so large register and memory dumps go out as full TCP segments
+ * instead of a byte at a time through gdb_if_putchar().
+ */
+
+#define gdb_fastpath_putpacketz(packet) gdb_if_putpacket((packet), strlen(packet))
+
+uint32_t gdb_load_bytes;
+uint32_t gdb_load_time_ms;
+uint32_t gdb_load_bytes_per_sec;
+static int64_t gdb_load_started_at;
+static uint32_t gdb_load_pending_bytes;
+
+/* 'm addr,len': Read len bytes from addr. The memory is read into the packet
+ * buffer just past where its hex encoding will end up, and hexified in place.
+ */
+static void gdb_fastpath_read_memory(char *pbuf, size_t pbuf_size)
+{
+	uint32_t addr;
+	uint32_t len;
+
+	if (!cur_target) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	if (sscanf(pbuf, "m%" SCNx32 ",%" SCNx32, &addr, &len) != 2) {
+		gdb_fastpath_putpacketz("E02");
+		return;
+	}
+	if (len * 2U >= pbuf_size) {
+		gdb_fastpath_putpacketz("E02");
+		return;
+	}
+	uint8_t *mem = (uint8_t *)pbuf + len;
+	if (gdb_memcache_read(cur_target, mem, addr, len)) {
+		gdb_fastpath_putpacketz("E01");
+		return;
+	}
+	gdb_if_putpacket(hexify(pbuf, mem, len), len * 2U);
+}
+
+/* 'M addr,len:XX..': Write len bytes to addr. Decoded in place, so that large
+ * packets need no room on the stack.
+ */
+static void gdb_fastpath_write_memory(char *pbuf, size_t size)
+{
+	uint32_t addr;
+	uint32_t len;
+	int hex_start = 0;
+
+	if (!cur_target) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	if (sscanf(pbuf, "M%" SCNx32 ",%" SCNx32 ":%n", &addr, &len, &hex_start) != 2 || !hex_start ||
+		len > (size - hex_start) / 2U) {
+		gdb_fastpath_putpacketz("E02");
+		return;
+	}
+	uint8_t *mem = (uint8_t *)pbuf;
+	unhexify(mem, pbuf + hex_start, len);
+	if (target_mem_write(cur_target, addr, mem, len)) {
+		gdb_fastpath_putpacketz("E01");
+		return;
+	}
+	gdb_fastpath_putpacketz("OK");
+}
+
+/* 'x addr,len': Read len bytes from addr, replying in binary. The memory is
+ * read into the packet buffer and escaped as it is sent.
+ */
+static void gdb_fastpath_read_memory_binary(char *pbuf, size_t pbuf_size)
+{
+	uint32_t addr;
+	uint32_t len;
+
+	if (!cur_target) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	if (sscanf(pbuf, "x%" SCNx32 ",%" SCNx32, &addr, &len) != 2) {
+		gdb_fastpath_putpacketz("E02");
+		return;
+	}
+	if (len > pbuf_size) {
+		gdb_fastpath_putpacketz("E02");
+		return;
+	}
+	if (gdb_memcache_read(cur_target, pbuf, addr, len)) {
+		gdb_fastpath_putpacketz("E01");
+		return;
+	}
+	gdb_if_putpacket_binary("b", 1, pbuf, len);
+}
+
+/* 'qSupported': Let blackmagic answer, then advertise this session's packet
+ * size and the features served here.
+ */
+static void gdb_fastpath_supported(struct bmp_wifi_instance *instance, char *pbuf, size_t pbuf_size, size_t size)
+{
+	static const char extra[] =
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+		"ConditionalBreakpoints+;BreakpointCommands+;"
+#endif
+#if CONFIG_GDB_TRACEPOINTS
+		"ConditionalTracepoints+;TracepointSource+;"
+#endif
+#if CONFIG_GDB_NON_STOP
+		"QNonStop+;"
+#endif
+		"binary-upload+";
+	char reply[256];
+
+	gdb_wifi_if_capture_start(instance, reply, sizeof(reply) - 1);
+	gdb_main(pbuf, pbuf_size, size);
+	size_t len = gdb_wifi_if_capture_stop(instance);
+
+	// Expect "$<features>#xx", possibly behind an ack
+	char *start = memchr(reply, '$', len);
+	char *end = start ? memchr(start, '#', len - (start - reply)) : NULL;
+	if (!end || (size_t)(end - start) + 16 + sizeof(extra) > pbuf_size) {
+		gdb_if_write(reply, len, true);
+		return;
+	}
+
+	*end = '\0';
+	size_t out = 0;
+	char *saveptr;
+	for (char *feature = strtok_r(start + 1, ";", &saveptr); feature; feature = strtok_r(NULL, ";", &saveptr)) {
+		if (!strncmp(feature, "PacketSize=", 11)) {
+			out += sprintf(pbuf + out, "PacketSize=%X;", (unsigned int)(pbuf_size - 1U));
+		} else {
+			out += sprintf(pbuf + out, "%s;", feature);
+		}
+	}
+	memcpy(pbuf + out, extra, sizeof(extra));
+	gdb_if_putpacket(pbuf, out + sizeof(extra) - 1U);
+}
+
+/* 'vCont?': Add range stepping to the actions blackmagic supports */
+static void gdb_fastpath_vcont_actions(struct bmp_wifi_instance *instance, char *pbuf, size_t pbuf_size, size_t size)
+{
+	char reply[64];
+
+	gdb_wifi_if_capture_start(instance, reply, sizeof(reply) - 1);
+	gdb_main(pbuf, pbuf_size, size);
+	size_t len = gdb_wifi_if_capture_stop(instance);
+
+	char *start = memchr(reply, '$', len);
+	char *end = start ? memchr(start, '#', len - (start - reply)) : NULL;
+	if (!end || end == start + 1 || !cur_target || !gdb_range_step_supported(cur_target) || instance->non_stop) {
+		gdb_if_write(reply, len, true);
+		return;
+	}
+
+	size_t out = end - start - 1;
+	memcpy(pbuf, start + 1, out);
+	memcpy(pbuf + out, ";r", 2);
+	gdb_if_putpacket(pbuf, out + 2);
+}
+
+/* 'vCont;rSTART,END[:thread]': Step while the PC stays in the range. Other
+ * vCont actions are left for blackmagic.
+ */
+static bool gdb_fastpath_range_step(struct bmp_wifi_instance *instance, const char *pbuf)
+{
+	uint32_t start;
+	uint32_t end;
+
+	if (!cur_target || sscanf(pbuf, "vCont;r%" SCNx32 ",%" SCNx32, &start, &end) != 2) {
+		return false;
+	}
+	return gdb_range_step(instance, cur_target, start, end);
+}
+
+#if CONFIG_GDB_NON_STOP
+uint32_t gdb_non_stop_resumes;
+
+/* Non-stop mode. GDB keeps talking to the probe while the target runs, and
+ * stops are sent as '%Stop:' notifications from the session poll. The target
+ * is reported as a single thread, "1".
+ */
+static bool gdb_fastpath_non_stop(struct bmp_wifi_instance *instance, char *pbuf)
+{
+	if (!strncmp(pbuf, "QNonStop:", 9) && (pbuf[9] == '0' || pbuf[9] == '1') && !pbuf[10]) {
+		instance->non_stop = pbuf[9] == '1';
+		gdb_fastpath_putpacketz("OK");
+		return true;
+	}
+	if (!instance->non_stop) {
+		return false;
+	}
+
+	if (!strcmp(pbuf, "vStopped")) {
+		// Stops are sent one at a time, so there is never another queued
+		gdb_fastpath_putpacketz("OK");
+		return true;
+	}
+	if (!cur_target) {
+		return false;
+	}
+	if (!strcmp(pbuf, "?")) {
+		gdb_non_stop_status(cur_target);
+		return true;
+	}
+	if ((pbuf[0] == 'g' || pbuf[0] == 'p') && gdb_target_running) {
+		// Memory can be read through the AP while the core runs, registers can't
+		gdb_fastpath_putpacketz("E01");
+		return true;
+	}
+	if (strncmp(pbuf, "vCont;", 6) != 0) {
+		return false;
+	}
+
+	// Only the first action matters, as there is a single thread
+	const char action = pbuf[6];
+	switch (action) {
+	case 't':
+		if (gdb_target_running) {
+			instance->halt_requested_at = esp_timer_get_time();
+			target_halt_request(cur_target);
+		}
+		break;
+	case 'c':
+	case 'C':
+	case 's':
+	case 'S':
+	case 'r':
+		// Range stepping is a single step here, GDB steps again while in range
+		if (!gdb_target_running) {
+			target_halt_resume(cur_target, action != 'c' && action != 'C');
+			gdb_target_running = true;
+			SET_RUN_STATE(1);
+			gdb_non_stop_resumes++;
+		}
+		break;
+	default:
+		return false;
+	}
+	gdb_fastpath_putpacketz("OK");
+	return true;
+}
+#endif
+
+/* 'g': Read general registers */
+static void gdb_fastpath_read_registers(char *pbuf, size_t pbuf_size)
+{
+	if (!cur_target) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	const size_t reg_size = target_regs_size(cur_target);
+	if (!reg_size || reg_size * 2U >= pbuf_size) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	uint8_t gp_regs[reg_size];
+	gdb_regcache_regs_read(cur_target, gp_regs, reg_size);
+	gdb_if_putpacket(hexify(pbuf, gp_regs, reg_size), reg_size * 2U);
+}
+
+/* 'G XX..': Write general registers, decoded in place */
+static void gdb_fastpath_write_registers(char *pbuf, size_t size)
+{
+	if (!cur_target) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	const size_t reg_size = target_regs_size(cur_target);
+	if (!reg_size || (size - 1U) / 2U < reg_size) {
+		gdb_fastpath_putpacketz("E01");
+		return;
+	}
+	uint8_t *gp_regs = (uint8_t *)pbuf;
+	unhexify(gp_regs, pbuf + 1, reg_size);
+	gdb_regcache_regs_write(cur_target, gp_regs, reg_size);
+	gdb_fastpath_putpacketz("OK");
+}
+
+/* 'p reg': Read one register */
+static void gdb_fastpath_read_register(char *pbuf)
+{
+	uint32_t reg;
+	uint8_t val[8];
+
+	if (!cur_target) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	if (sscanf(pbuf, "p%" SCNx32, &reg) != 1) {
+		gdb_fastpath_putpacketz("E02");
+		return;
+	}
+	size_t reg_len = gdb_regcache_reg_read(cur_target, reg, val, sizeof(val));
+	if (!reg_len) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	gdb_if_putpacket(hexify(pbuf, val, reg_len), reg_len * 2U);
+}
+
+/* 'P reg=XX..': Write one register */
+static void gdb_fastpath_write_register(char *pbuf)
+{
+	uint32_t reg;
+	int value_start = 0;
+	uint8_t val[8];
+
+	if (!cur_target) {
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	if (sscanf(pbuf, "P%" SCNx32 "=%n", &reg, &value_start) != 1 || !value_start) {
+		gdb_fastpath_putpacketz("E02");
+		return;
+	}
+	size_t value_len = strlen(pbuf + value_start) / 2U;
+	if (value_len > sizeof(val)) {
+		gdb_fastpath_putpacketz("E02");
+		return;
+	}
+	unhexify(val, pbuf + value_start, value_len);
+	if (gdb_regcache_reg_write(cur_target, reg, val, value_len) > 0) {
+		gdb_fastpath_putpacketz("OK");
+	} else {
+		gdb_fastpath_putpacketz("E81");
+	}
+}
+
+/* Time each flash load from its first vFlashErase to its vFlashDone, and
+ * count the bytes written in between. The packet size decides how many
+ * round trips a load takes, so this is what to compare between sizes.
+ */
+static void gdb_fastpath_load_packet(const char *pbuf, size_t size)
+{
+	if (!strncmp(pbuf, "vFlashErase", 11)) {
+		if (!gdb_load_started_at) {
+			gdb_load_started_at = esp_timer_get_time();
+			gdb_load_pending_bytes = 0;
+		}
+	} else if (!strncmp(pbuf, "vFlashWrite:", 12)) {
+		const char *data = memchr(pbuf + 12, ':', size - 12);
+		if (data) {
+			gdb_load_pending_bytes += size - (data + 1 - pbuf);
+		}
+	}
+}
+
+static void gdb_fastpath_load_done(size_t pbuf_size)
+{
+	if (!gdb_load_started_at) {
+		return;
+	}
+	uint32_t elapsed_ms = (esp_timer_get_time() - gdb_load_started_at) / 1000;
+	gdb_load_started_at = 0;
+	if (elapsed_ms == 0) {
+		elapsed_ms = 1;
+	}
+
+	gdb_load_bytes = gdb_load_pending_bytes;
+	gdb_load_time_ms = elapsed_ms;
+	gdb_load_bytes_per_sec = ((uint64_t)gdb_load_bytes * 1000) / elapsed_ms;
+	ESP_LOGI("gdb", "load: %" PRIu32 " bytes in %" PRIu32 " ms (%" PRIu32 " bytes/s) with %u byte packets",
+		gdb_load_bytes, gdb_load_time_ms, gdb_load_bytes_per_sec, (unsigned int)(pbuf_size - 1U));
+}
+
+/* Report a failed pipelined write in place of this vFlash packet's reply */
+static bool gdb_fastpath_flash_failed(struct bmp_wifi_instance *instance)
+{
+	if (!instance->flash_write_failed) {
+		return false;
+	}
+	instance->flash_write_failed = false;
+	gdb_fastpath_putpacketz("EFF");
+	return true;
+}
+
+/* 'vFlashWrite:addr:XX..': Program flash. In no-ack mode GDB only waits for
+ * the reply, so send "OK" first and program the block while GDB sends the
+ * next one, which the receive task picks up in the meantime. A failure is
+ * reported in reply to the next vFlash packet instead.
+ */
+static bool gdb_fastpath_flash_write(struct bmp_wifi_instance *instance, char *pbuf, size_t size)
+{
+	uint32_t addr;
+	int data_start = 0;
+
+	if (!cur_target) {
+		return false;
+	}
+#if !CONFIG_GDB_INCREMENTAL_FLASH
+	if (!instance->no_ack_mode) {
+		return false;
+	}
+#endif
+	if (sscanf(pbuf, "vFlashWrite:%08" SCNx32 ":%n", &addr, &data_start) != 1 || !data_start) {
+		return false;
+	}
+
+	if (gdb_fastpath_flash_failed(instance)) {
+		return true;
+	}
+	if (instance->no_ack_mode) {
+		gdb_fastpath_putpacketz("OK");
+	}
+#if CONFIG_GDB_INCREMENTAL_FLASH
+	bool ok = gdb_flash_write(cur_target, addr, (uint8_t *)pbuf + data_start, size - data_start);
+	if (!ok) {
+		gdb_flash_abort();
+	}
+#else
+	bool ok = target_flash_write(cur_target, addr, (uint8_t *)pbuf + data_start, size - data_start);
+#endif
+	if (!ok) {
+		ESP_LOGE("gdb", "flash write of %u bytes at 0x%08" PRIx32 " failed", (unsigned int)(size - data_start), addr);
+		target_flash_complete(cur_target);
+		instance->flash_write_failed = instance->no_ack_mode;
+	}
+	if (!instance->no_ack_mode) {
+		gdb_fastpath_putpacketz(ok ? "OK" : "EFF");
+	}
+	return true;
+}
+
+#if CONFIG_GDB_INCREMENTAL_FLASH
+/* 'vFlashErase:addr,len': Defer the erase, see gdb_flash.c. The packet
+ * buffer is free once the arguments are parsed, and is used to fetch the
+ * target's memory map.
+ */
+static bool gdb_fastpath_flash_erase(char *pbuf, size_t pbuf_size)
+{
+	uint32_t addr;
+	uint32_t len;
+
+	if (!cur_target || sscanf(pbuf, "vFlashErase:%08" SCNx32 ",%08" SCNx32, &addr, &len) != 2) {
+		return false;
+	}
+	if (gdb_flash_erase(cur_target, addr, len, pbuf, pbuf_size)) {
+		gdb_fastpath_putpacketz("OK");
+	} else {
+		gdb_flash_abort();
+		gdb_fastpath_putpacketz("EFF");
+	}
+	return true;
+}
+
+/* 'vFlashDone': Program what is still pending, then let blackmagic finish */
+static void gdb_fastpath_flash_done(char *pbuf, size_t pbuf_size, size_t size)
+{
+	if (cur_target && !gdb_flash_done(cur_target)) {
+		target_flash_complete(cur_target);
+		gdb_fastpath_putpacketz("EFF");
+		return;
+	}
+	gdb_main(pbuf, pbuf_size, size);
+}
+#endif
+
+#if CONFIG_GDB_CRC_STUB
+/* 'qCRC:addr,len': Let the target compute the CRC if it can. It runs code
+ * on the target, so only the owner may do that; blackmagic reads the memory
+ * back for everyone else.
+ */
+static bool gdb_fastpath_crc(struct bmp_wifi_instance *instance, const char *pbuf)
+{
+	uint32_t addr;
+	uint32_t len;
+	uint32_t crc;
+	char reply[10];
+
+	if (!cur_target || !gdb_target_is_owner(instance) ||
+		sscanf(pbuf, "qCRC:%" SCNx32 ",%" SCNx32, &addr, &len) != 2) {
+		return false;
+	}
+	if (!gdb_crc_stub(cur_target, addr, len, &crc)) {
+		return false;
+	}
+	snprintf(reply, sizeof(reply), "C%08" PRIx32, crc);
+	gdb_fastpath_putpacketz(reply);
+	return true;
+}
+#endif
+
+/* Packets an observer may send. These only read target state, or only
+ * affect the session that sent them.
+ */
+static bool gdb_fastpath_is_read_only(const char *pbuf)
+{
+	switch (pbuf[0]) {
+	case '?':
+	case '!':
+	case 'g':
+	case 'm':
+	case 'p':
+	case 'x':
+	case 'H':
+	case 'T':
+		return true;
+	case 'q':
+		return strncmp(pbuf, "qRcmd,", 6) != 0;
+	case 'v':
+		return !strcmp(pbuf, "vMustReplyEmpty") || !strcmp(pbuf, "vCont?");
+	case 'Q':
+		return !strcmp(pbuf, "QStartNoAckMode");
+	default:
+		return false;
+	}
+}
+
+/* Whether a packet attaches to a target or rescans for targets. Either way
+ * the target has no breakpoints afterwards, whatever `target_s` it gets.
+ */
+static bool gdb_fastpath_replaces_target(const char *pbuf)
+{
+	static const char *const scans[] = {"swdp_scan", "jtag_scan", "auto_scan"};
+	char cmd[10];
+
+	if (!strncmp(pbuf, "vAttach;", 8)) {
+		return true;
+	}
+	if (strncmp(pbuf, "qRcmd,", 6) != 0) {
+		return false;
+	}
+	const size_t len = MIN(strlen(pbuf + 6) / 2U, sizeof(cmd) - 1U);
+	unhexify(cmd, pbuf + 6, len);
+	cmd[len] = '\0';
+	for (size_t i = 0; i < ARRAY_LENGTH(scans); i++) {
+		if (!strncmp(cmd, scans[i], strlen(scans[i]))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool cmd_observe(struct bmp_wifi_instance *instance, int argc, const char **argv)
+{
+	(void)argc;
+	(void)argv;
+	gdb_target_release(instance);
+	gdb_out("This session is now a read-only observer\n");
+	return true;
+}
+
+static bool cmd_control(struct bmp_wifi_instance *instance, int argc, const char **argv)
+{
+	(void)argc;
+	(void)argv;
+	int position = gdb_target_claim(instance);
+	if (position == 0) {
+		gdb_out("This session owns the target\n");
+	} else {
+		gdb_outf("Target is owned by another session. Queued at position %d\n", position);
+	}
+	return true;
+}
+
+static bool cmd_memcache(struct bmp_wifi_instance *instance, int argc, const char **argv)
+{
+	(void)instance;
+	return gdb_memcache_command(argc, argv);
+}
+
+static bool cmd_prefetch(struct bmp_wifi_instance *instance, int argc, const char **argv)
+{
+	(void)instance;
+	return gdb_prefetch_command(argc, argv);
+}
+
+#if CONFIG_GDB_CRC_STUB
+static bool cmd_crc(struct bmp_wifi_instance *instance, int argc, const char **argv)
+{
+	(void)instance;
+	return gdb_crc_command(argc, argv);
+}
+#endif
+
+#if CONFIG_GDB_SCAN_CACHE
+static bool cmd_scan_cache(struct bmp_wifi_instance *instance, int argc, const char **argv)
+{
+	(void)instance;
+	return gdb_scan_cache_command(argc, argv);
+}
+#endif
+
+/* `owner_argc` is the number of words from which a command changes shared
+ * state and needs control of the target, or 0 if it never does.
+ */
+static const struct {
+	const char *cmd;
+	bool (*handler)(struct bmp_wifi_instance *instance, int argc, const char **argv);
+	int owner_argc;
+	const char *help;
+} gdb_fastpath_cmds[] = {
+	{"observe", cmd_observe, 0, "Give up control of the target and only observe it"},
+	{"control", cmd_control, 0, "Take control of the target, waiting for the current owner if needed"},
+	{"memcache", cmd_memcache, 2, "Show or configure the target memory cache: [on|off|flush|volatile <addr> <len>]"},
+	{"prefetch", cmd_prefetch, 2, "Show or configure stack prefetch on halt: [on|off|<stack bytes>]"},
+#if CONFIG_GDB_CRC_STUB
+	{"crc", cmd_crc, 1, "Compare the target and probe CRC of memory: <addr> <len>"},
+#endif
+#if CONFIG_GDB_SCAN_CACHE
+	{"scan_cache", cmd_scan_cache, 2, "Show or clear the cached swdp_scan result: [clear]"},
+#endif
+};
+
+/* 'qRcmd,<hex>': Farpatch monitor commands. Anything not listed here is
+ * left for blackmagic.
+ */
+static bool gdb_fastpath_monitor(struct bmp_wifi_instance *instance, const char *pbuf)
+{
+	char cmdline[64];
+	const char *argv[8];
+	int argc = 0;
+	char *saveptr;
+
+	size_t hex_len = strlen(pbuf + 6);
+	if (hex_len / 2U >= sizeof(cmdline)) {
+		return false;
+	}
+	unhexify(cmdline, pbuf + 6, hex_len / 2U);
+	cmdline[hex_len / 2U] = '\0';
+
+	for (char *tok = strtok_r(cmdline, " \t", &saveptr); tok && argc < (int)ARRAY_LENGTH(argv);
+		 tok = strtok_r(NULL, " \t", &saveptr)) {
+		argv[argc++] = tok;
+	}
+	if (argc == 0) {
+		return false;
+	}
+
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_fastpath_cmds); i++) {
+		if (!strcmp(argv[0], gdb_fastpath_cmds[i].cmd)) {
+			const int owner_argc = gdb_fastpath_cmds[i].owner_argc;
+			if (owner_argc && argc >= owner_argc) {
+				const int position = gdb_target_claim(instance);
+				if (position != 0) {
+					gdb_outf("Target is owned by another session. Queued at position %d\n", position);
+					gdb_fastpath_putpacketz("E05");
+					return true;
+				}
+			}
+			if (gdb_fastpath_cmds[i].handler(instance, argc, argv)) {
+				gdb_fastpath_putpacketz("OK");
+			} else {
+				gdb_fastpath_putpacketz("E");
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+/* A packet that needs control of the target arrived from a session that
+ * doesn't have it.
+ */
+static bool gdb_fastpath_observer(struct bmp_wifi_instance *instance, const char *pbuf, int position)
+{
+	switch (pbuf[0]) {
+	case '\x04':
+		// GDB went away. Leave the owner's target attached.
+		gdb_target_release(instance);
+		return true;
+
+	case 'D':
+		gdb_target_release(instance);
+		gdb_fastpath_putpacketz("OK");
+		return true;
+
+	case 'q':
+		gdb_outf("Target is owned by another session. Queued at position %d\n", position);
+		gdb_fastpath_putpacketz("E05");
+		return true;
+
+	default:
+		gdb_fastpath_putpacketz("E05");
+		return true;
+	}
+}
+
+bool gdb_fastpath_handle(struct bmp_wifi_instance *instance, char *pbuf, size_t pbuf_size, size_t size)
+{
+	if (!strncmp(pbuf, "qRcmd,", 6) && gdb_fastpath_monitor(instance, pbuf)) {
+		return true;
+	}
+
+	if (!gdb_fastpath_is_read_only(pbuf)) {
+		int position = gdb_target_claim(instance);
+		if (position != 0) {
+			return gdb_fastpath_observer(instance, pbuf, position);
+		}
+		// Anything but a read may change target memory. Register writes keep
+		// the register cache up to date themselves.
+		gdb_memcache_invalidate();
+		if (pbuf[0] != 'P' && pbuf[0] != 'G') {
+			gdb_regcache_invalidate();
+		}
+	}
+
+#if CONFIG_GDB_SCAN_CACHE
+	if (!strncmp(pbuf, "qRcmd,", 6) && gdb_scan_cache_packet(pbuf, pbuf_size, size)) {
+		return true;
+	}
+#endif
+	if (gdb_fastpath_replaces_target(pbuf)) {
+		gdb_target_state_clear();
+	}
+#if CONFIG_GDB_NON_STOP
+	if (gdb_fastpath_non_stop(instance, pbuf)) {
+		return true;
+	}
+#endif
+#if CONFIG_GDB_TRACEPOINTS
+	// Trace packets, and reads from a selected trace frame
+	if (cur_target && gdb_trace_packet(cur_target, pbuf, pbuf_size)) {
+		return true;
+	}
+#endif
+#if CONFIG_GDB_RTOS_THREADS
+	// Thread queries, and registers of tasks that aren't running
+	if (cur_target && gdb_rtos_packet(instance, cur_target, pbuf, pbuf_size)) {
+		return true;
+	}
+#endif
+
+	switch (pbuf[0]) {
+	case 'm':
+		gdb_fastpath_read_memory(pbuf, pbuf_size);
+		return true;
+
+	case 'M':
+		gdb_fastpath_write_memory(pbuf, size);
+		return true;
+
+	case 'v':
+		gdb_fastpath_load_packet(pbuf, size);
+		if (!strncmp(pbuf, "vFlashWrite:", 12)) {
+			return gdb_fastpath_flash_write(instance, pbuf, size);
+		}
+		if (!strncmp(pbuf, "vFlashErase:", 12)) {
+#if CONFIG_GDB_INCREMENTAL_FLASH
+			return gdb_fastpath_flash_failed(instance) || gdb_fastpath_flash_erase(pbuf, pbuf_size);
+#else
+			return gdb_fastpath_flash_failed(instance);
+#endif
+		}
+		if (!strcmp(pbuf, "vCont?")) {
+			gdb_fastpath_vcont_actions(instance, pbuf, pbuf_size, size);
+			return true;
+		}
+		if (!strncmp(pbuf, "vCont;r", 7)) {
+			return gdb_fastpath_range_step(instance, pbuf);
+		}
+		if (!strcmp(pbuf, "vFlashDone")) {
+			if (!gdb_fastpath_flash_failed(instance)) {
+#if CONFIG_GDB_INCREMENTAL_FLASH
+				gdb_fastpath_flash_done(pbuf, pbuf_size, size);
+#else
+				gdb_main(pbuf, pbuf_size, size);
+#endif
+			}
+			gdb_fastpath_load_done(pbuf_size);
+			return true;
+		}
+		return false;
+
+	case 'x':
+		gdb_fastpath_read_memory_binary(pbuf, pbuf_size);
+		return true;
+
+	case 'g':
+		gdb_fastpath_read_registers(pbuf, pbuf_size);
+		return true;
+
+	case 'G':
+		gdb_fastpath_write_registers(pbuf, size);
+		return true;
+
+	case 'p':
+		gdb_fastpath_read_register(pbuf);
+		return true;
+
+	case 'P':
+		gdb_fastpath_write_register(pbuf);
+		return true;
+
+	case 'q':
+		if (!strncmp(pbuf, "qSupported", 10)) {
+			gdb_fastpath_supported(instance, pbuf, pbuf_size, size);
+			return true;
+		}
+#if CONFIG_GDB_CRC_STUB
+		if (!strncmp(pbuf, "qCRC:", 5)) {
+			return gdb_fastpath_crc(instance, pbuf);
+		}
+#endif
+		return false;
+
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+	case 'Z':
+		return cur_target && gdb_breakpoint_insert(cur_target, pbuf);
+
+	case 'z':
+		return cur_target && gdb_breakpoint_remove(cur_target, pbuf);
+
+#endif
+	case '\x04':
+		// Blackmagic drops back to ack mode when the connection is reset
+		instance->no_ack_mode = false;
+		return false;
+
+	case 'Q':
+		// Let blackmagic acknowledge the request, then stop waiting for acks
+		// on replies that are sent from here.
+		if (!strcmp(pbuf, "QStartNoAckMode")) {
+			gdb_main(pbuf, pbuf_size, size);
+			instance->no_ack_mode = true;
+			return true;
+		}
+		return false;
+
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,269 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "gdb_main_farpatch.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "target.h"
+#include "target_internal.h"
+
+#if CONFIG_GDB_INCREMENTAL_FLASH
+
+/* Incremental flash programming. GDB erases every block of the image with
+ * vFlashErase before it writes any of them, so most of a reflash with a
+ * nearly identical image is spent erasing and rewriting data that is
+ * already there. Instead, erases are only recorded. Each block's new
+ * contents are collected as vFlashWrite packets arrive and compared with
+ * what the target holds, and the block is only erased and programmed if
+ * they differ. Blocks that were erased but never written are only erased
+ * if they aren't blank already.
+ *
+ * Block sizes come from the target's memory map. Blocks larger than
+ * CONFIG_GDB_INCREMENTAL_FLASH_MAX_BLOCK are erased and written as usual.
+ */
+
+#define TAG "gdb_flash"
+
+#define GDB_FLASH_MAX_RANGES 8
+#define GDB_FLASH_COMPARE_CHUNK 256U
+
+struct gdb_flash_range {
+	uint32_t start;
+	uint32_t end;
+	uint32_t blocksize;
+	/* What an erased byte reads as, 0xff on most flash but 0x00 on some */
+	uint8_t erased;
+};
+
+uint32_t gdb_flash_blocks_written;
+uint32_t gdb_flash_blocks_erased;
+uint32_t gdb_flash_blocks_skipped;
+
+static target_s *gdb_flash_target;
+static struct gdb_flash_range gdb_flash_ranges[GDB_FLASH_MAX_RANGES];
+static size_t gdb_flash_range_count;
+
+/* Blocks below this address in the deferred ranges have been dealt with */
+static uint32_t gdb_flash_cursor;
+
+/* The block whose new contents are being collected */
+static uint8_t *gdb_flash_block;
+static uint32_t gdb_flash_block_addr;
+static uint32_t gdb_flash_block_size;
+
+/* Counts for the load in progress */
+static uint32_t gdb_flash_load_written;
+static uint32_t gdb_flash_load_erased;
+static uint32_t gdb_flash_load_skipped;
+
+static void gdb_flash_reset(void)
+{
+	free(gdb_flash_block);
+	gdb_flash_block = NULL;
+	gdb_flash_block_size = 0;
+	gdb_flash_range_count = 0;
+	gdb_flash_cursor = 0;
+	gdb_flash_load_written = 0;
+	gdb_flash_load_erased = 0;
+	gdb_flash_load_skipped = 0;
+	gdb_flash_target = NULL;
+}
+
+void gdb_flash_abort(void)
+{
+	gdb_flash_reset();
+}
+
+/* Look up the erase block size for `addr` in the target's memory map */
+static uint32_t gdb_flash_blocksize(target_s *t, uint32_t addr, char *scratch, size_t scratch_size)
+{
+	if (!target_mem_map(t, scratch, scratch_size)) {
+		return 0;
+	}
+
+	for (const char *p = strstr(scratch, "<memory type=\"flash\""); p; p = strstr(p + 1, "<memory type=\"flash\"")) {
+		const char *start = strstr(p, "start=\"");
+		const char *length = strstr(p, "length=\"");
+		const char *blocksize = strstr(p, "\"blocksize\">");
+		if (!start || !length || !blocksize) {
+			break;
+		}
+		uint32_t region_start = strtoul(start + 7, NULL, 0);
+		uint32_t region_length = strtoul(length + 8, NULL, 0);
+		if (addr >= region_start && addr - region_start < region_length) {
+			return strtoul(blocksize + 12, NULL, 0);
+		}
+	}
+	return 0;
+}
+
+static const struct gdb_flash_range *gdb_flash_find_range(uint32_t addr)
+{
+	for (size_t i = 0; i < gdb_flash_range_count; i++) {
+		if (addr >= gdb_flash_ranges[i].start && addr < gdb_flash_ranges[i].end) {
+			return &gdb_flash_ranges[i];
+		}
+	}
+	return NULL;
+}
+
+/* Whether the target already holds `data` at `addr` */
+static bool gdb_flash_matches(target_s *t, uint32_t addr, const uint8_t *data, size_t len)
+{
+	uint8_t chunk[GDB_FLASH_COMPARE_CHUNK];
+
+	for (size_t offset = 0; offset < len; offset += sizeof(chunk)) {
+		size_t count = MIN(sizeof(chunk), len - offset);
+		if (target_mem_read(t, chunk, addr + offset, count) || memcmp(chunk, data + offset, count)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Bring one block in line with `data`, touching the flash only if needed */
+static bool gdb_flash_commit(target_s *t, uint32_t addr, const uint8_t *data, size_t len, bool has_data)
+{
+	if (gdb_flash_matches(t, addr, data, len)) {
+		gdb_flash_load_skipped++;
+		return true;
+	}
+
+	if (!target_flash_erase(t, addr, len)) {
+		return false;
+	}
+	if (!has_data) {
+		gdb_flash_load_erased++;
+		return true;
+	}
+	gdb_flash_load_written++;
+	return target_flash_write(t, addr, data, len);
+}
+
+static bool gdb_flash_commit_block(target_s *t)
+{
+	if (!gdb_flash_block_size) {
+		return true;
+	}
+	bool ok = gdb_flash_commit(t, gdb_flash_block_addr, gdb_flash_block, gdb_flash_block_size, true);
+	gdb_flash_block_size = 0;
+	return ok;
+}
+
+/* Deal with the deferred blocks below `limit` that nothing was written to.
+ * They should end up blank.
+ */
+static bool gdb_flash_advance(target_s *t, uint32_t limit)
+{
+	for (size_t i = 0; i < gdb_flash_range_count; i++) {
+		const struct gdb_flash_range *range = &gdb_flash_ranges[i];
+		uint32_t addr = MAX(range->start, gdb_flash_cursor);
+		for (; addr < range->end && addr < limit; addr += range->blocksize) {
+			memset(gdb_flash_block, range->erased, range->blocksize);
+			if (!gdb_flash_commit(t, addr, gdb_flash_block, range->blocksize, false)) {
+				return false;
+			}
+		}
+	}
+	gdb_flash_cursor = MAX(gdb_flash_cursor, limit);
+	return true;
+}
+
+bool gdb_flash_erase(target_s *t, uint32_t addr, size_t len, char *scratch, size_t scratch_size)
+{
+	if (t != gdb_flash_target) {
+		// First erase of a load. blackmagic resets the target at this point,
+		// but it never sees these packets now.
+		gdb_flash_reset();
+		gdb_flash_target = t;
+		target_reset(t);
+	}
+
+	uint32_t blocksize = gdb_flash_blocksize(t, addr, scratch, scratch_size);
+	const target_flash_s *flash = target_flash_for_addr(t, addr);
+	if (!blocksize || !flash || blocksize > CONFIG_GDB_INCREMENTAL_FLASH_MAX_BLOCK || (addr % blocksize) ||
+		(len % blocksize) || gdb_flash_range_count == GDB_FLASH_MAX_RANGES) {
+		return target_flash_erase(t, addr, len);
+	}
+	if (!gdb_flash_block) {
+		gdb_flash_block = malloc(CONFIG_GDB_INCREMENTAL_FLASH_MAX_BLOCK);
+		if (!gdb_flash_block) {
+			ESP_LOGW(TAG, "no memory for incremental flashing");
+			return target_flash_erase(t, addr, len);
+		}
+	}
+
+	struct gdb_flash_range *range = &gdb_flash_ranges[gdb_flash_range_count++];
+	range->start = addr;
+	range->end = addr + len;
+	range->blocksize = blocksize;
+	range->erased = flash->erased;
+	return true;
+}
+
+bool gdb_flash_write(target_s *t, uint32_t addr, const uint8_t *data, size_t len)
+{
+	while (len) {
+		const struct gdb_flash_range *range = t == gdb_flash_target ? gdb_flash_find_range(addr) : NULL;
+		if (!range) {
+			// Not deferred, so it was erased as usual
+			return gdb_flash_commit_block(t) && target_flash_write(t, addr, data, len);
+		}
+
+		uint32_t block_addr = addr - ((addr - range->start) % range->blocksize);
+		if (!gdb_flash_block_size || block_addr != gdb_flash_block_addr) {
+			if (!gdb_flash_commit_block(t)) {
+				return false;
+			}
+			if (block_addr >= gdb_flash_cursor) {
+				if (!gdb_flash_advance(t, block_addr)) {
+					return false;
+				}
+				memset(gdb_flash_block, range->erased, range->blocksize);
+				gdb_flash_cursor = block_addr + range->blocksize;
+			} else {
+				// GDB went back to a block that is already done, so the
+				// target holds what it should there. Start from that.
+				if (target_mem_read(t, gdb_flash_block, block_addr, range->blocksize)) {
+					return false;
+				}
+			}
+			gdb_flash_block_addr = block_addr;
+			gdb_flash_block_size = range->blocksize;
+		}
+
+		size_t offset = addr - block_addr;
+		size_t count = MIN(len, gdb_flash_block_size - offset);
+		memcpy(gdb_flash_block + offset, data, count);
+		addr += count;
+		data += count;
+		len -= count;
+	}
+	return true;
+}
+
+bool gdb_flash_done(target_s *t)
+{
+	bool ok = true;
+	if (t == gdb_flash_target && gdb_flash_block) {
+		ok = gdb_flash_commit_block(t) && gdb_flash_advance(t, UINT32_MAX);
+	}
+
+	gdb_flash_blocks_written += gdb_flash_load_written;
+	gdb_flash_blocks_erased += gdb_flash_load_erased;
+	gdb_flash_blocks_skipped += gdb_flash_load_skipped;
+	if (gdb_flash_load_written || gdb_flash_load_erased || gdb_flash_load_skipped) {
+		// Console output isn't allowed in the reply to vFlashDone
+		ESP_LOGI(TAG, "%" PRIu32 " blocks written, %" PRIu32 " erased, %" PRIu32 " unchanged", gdb_flash_load_written,
+			gdb_flash_load_erased, gdb_flash_load_skipped);
+	}
+
+	gdb_flash_reset();
+	return ok;
+}
+
+#endif /* CONFIG_GDB_INCREMENTAL_FLASH */
@@ -22,6 +22,7 @@
  * Serial Debugging protocol is implemented.  This implementation for Linux
  * uses a TCP server on port 2022.
  */
+#include <errno.h>
 #include <stdio.h>
 
 #include <lwip/err.h>
@@ -30,8 +31,11 @@
 #include <lwip/sys.h>
 
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/message_buffer.h>
+#include <freertos/task.h>
 #include <freertos/timers.h>
 
 #include "gdb_if.h"
@@ -39,6 +43,7 @@
 #include "gdb_hostio.h"
 
 #include "exception.h"
+#include "gdb_main_farpatch.h"
 #include "general.h"
 #include "hex_utils.h"
 #include "target.h"
@@ -46,94 +51,603 @@
 #include <string.h>
 #include <assert.h>
 
-#define GDB_TLS_INDEX     1
-#define EXCEPTION_NETWORK 0x40
+uint32_t gdb_wifi_rx_bytes;
+uint32_t gdb_wifi_rx_calls;
+uint32_t gdb_wifi_poll_calls;
+uint32_t gdb_wifi_tx_bytes;
+uint32_t gdb_wifi_tx_calls;
+uint32_t gdb_wifi_rle_saved;
 
-struct gdb_wifi_instance {
-	int sock;
-	uint8_t buf[256];
-	int bufsize;
-	bool no_ack_mode;
-	bool is_shutting_down;
-	TaskHandle_t pid;
+enum gdb_wifi_rx_state {
+	GDB_WIFI_RX_IDLE,
+	GDB_WIFI_RX_PACKET,
+	GDB_WIFI_RX_CSUM1,
+	GDB_WIFI_RX_CSUM2,
 };
 
-static unsigned char gdb_wifi_if_getchar(struct gdb_wifi_instance *instance)
+/* Per-connection state, reset whenever a session slot takes a new connection */
+static void gdb_wifi_if_reset(struct bmp_wifi_instance *instance)
 {
-	uint8_t tmp;
-	int ret;
+	instance->tx_bufsize = 0;
+	instance->tx_capture = NULL;
+	instance->no_ack_mode = false;
+	instance->is_shutting_down = false;
+	instance->break_pending = false;
+	instance->rx_closed = false;
+	instance->break_at_us = 0;
+	instance->holds_target_lock = false;
+	instance->owner_queue_next = NULL;
+	instance->flash_write_failed = false;
+	instance->rtos_thread = 0;
+	instance->non_stop = false;
+	instance->answering = false;
+	instance->rx_fifo_head = 0;
+	instance->rx_fifo_tail = 0;
+}
 
-	if (instance->is_shutting_down) {
-		return 0;
+#if !CONFIG_GDB_SERVER_MULTIPLEXED
+/* Receive task: hand whatever has been framed so far to the session task.
+ * Returns `false` if the session is going away.
+ */
+static bool gdb_wifi_rx_deliver(struct bmp_wifi_instance *instance)
+{
+	while (instance->rx_frame_len) {
+		if (xMessageBufferSend(instance->rx_packets, instance->rx_frame, instance->rx_frame_len,
+				pdMS_TO_TICKS(GDB_WIFI_RX_SLICE_MS))) {
+			instance->rx_frame_len = 0;
+			// In non-stop mode the session task polls the target between packets
+			if (instance->non_stop) {
+				xTaskNotifyGive(instance->pid);
+			}
+			return true;
+		}
+		if (instance->is_shutting_down) {
+			return false;
+		}
 	}
+	return true;
+}
 
-	ret = recv(instance->sock, &tmp, 1, 0);
-	if (ret <= 0) {
-		instance->is_shutting_down = true;
-		raise_exception(EXCEPTION_NETWORK, "error on getchar");
-		// should not be reached
-		return 0;
+/* Receive task: split the byte stream into RSP frames. A break that arrives
+ * between packets is flagged out-of-band rather than queued behind them.
+ */
+static bool gdb_wifi_rx_parse(struct bmp_wifi_instance *instance, uint8_t c)
+{
+	switch (instance->rx_frame_state) {
+	case GDB_WIFI_RX_IDLE:
+		if (c == '\x03') {
+			instance->break_at_us = esp_timer_get_time();
+			instance->break_pending = true;
+			xTaskNotifyGive(instance->pid);
+			return true;
+		}
+		instance->rx_frame[instance->rx_frame_len++] = c;
+		if (c != '$') {
+			// Acks, naks and EOT are passed on one byte at a time
+			return gdb_wifi_rx_deliver(instance);
+		}
+		instance->rx_frame_state = GDB_WIFI_RX_PACKET;
+		return true;
+
+	case GDB_WIFI_RX_PACKET:
+		if (c == '#') {
+			instance->rx_frame_state = GDB_WIFI_RX_CSUM1;
+		}
+		break;
+
+	case GDB_WIFI_RX_CSUM1:
+		instance->rx_frame_state = GDB_WIFI_RX_CSUM2;
+		break;
+
+	case GDB_WIFI_RX_CSUM2:
+		instance->rx_frame[instance->rx_frame_len++] = c;
+		instance->rx_frame_state = GDB_WIFI_RX_IDLE;
+		return gdb_wifi_rx_deliver(instance);
+	}
+
+	instance->rx_frame[instance->rx_frame_len++] = c;
+	// Oversized packets are passed on in pieces and left for gdb_getpacket()
+	// to reject.
+	if (instance->rx_frame_len == sizeof(instance->rx_frame)) {
+		return gdb_wifi_rx_deliver(instance);
+	}
+	return true;
+}
+
+static void gdb_wifi_rx_task(void *arg)
+{
+	struct bmp_wifi_instance *instance = (struct bmp_wifi_instance *)arg;
+
+	while (true) {
+		// Park until gdb_wifi_if_start() hands over a new connection
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		while (!instance->is_shutting_down) {
+			int ret = recv(instance->sock, instance->rx_net, sizeof(instance->rx_net), 0);
+			if (ret <= 0) {
+				break;
+			}
+			gdb_wifi_rx_bytes += ret;
+			gdb_wifi_rx_calls++;
+
+			for (int i = 0; i < ret; i++) {
+				if (!gdb_wifi_rx_parse(instance, instance->rx_net[i])) {
+					break;
+				}
+			}
+		}
+
+		ESP_LOGI("gdb", "receive task for %d finished", instance->sock);
+		instance->rx_closed = true;
+		// The session may reuse `instance` as soon as this is cleared
+		instance->rx_task_running = false;
+	}
+}
+
+void gdb_wifi_if_init(struct bmp_wifi_instance *instance, int slot, StackType_t *rx_stack, uint32_t rx_stack_size,
+	StaticTask_t *rx_task)
+{
+	char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];
+	snprintf(name, sizeof(name) - 1, "gdbr %d", slot);
+
+	instance->rx_packets =
+		xMessageBufferCreateStatic(sizeof(instance->rx_packets_storage), instance->rx_packets_storage,
+			&instance->rx_packets_buffer);
+	assert(instance->rx_packets);
+
+	// Run above the session task so that a break is seen while the session
+	// is busy talking to the target.
+	instance->rx_pid = xTaskCreateStatic(
+		gdb_wifi_rx_task, name, rx_stack_size, (void *)instance, tskIDLE_PRIORITY + 2, rx_stack, rx_task);
+	assert(instance->rx_pid);
+}
+
+void gdb_wifi_if_start(struct bmp_wifi_instance *instance)
+{
+	gdb_wifi_if_reset(instance);
+	instance->rx_frame_state = GDB_WIFI_RX_IDLE;
+	instance->rx_frame_len = 0;
+	xMessageBufferReset(instance->rx_packets);
+
+	instance->rx_task_running = true;
+	xTaskNotifyGive(instance->rx_pid);
+}
+
+void gdb_wifi_if_stop(struct bmp_wifi_instance *instance)
+{
+	instance->is_shutting_down = true;
+	shutdown(instance->sock, SHUT_RDWR);
+
+	// The receive task is reused by the next connection on this slot, so it
+	// can't be deleted. The shutdown above unblocks recv() promptly.
+	for (int i = 1; instance->rx_task_running; i++) {
+		vTaskDelay(pdMS_TO_TICKS(10));
+		if ((i % 100) == 0) {
+			ESP_LOGW("gdb", "still waiting for the receive task for %d", instance->sock);
+		}
+	}
+}
+
+bool gdb_wifi_if_ready(struct bmp_wifi_instance *instance)
+{
+	return instance->rx_closed || instance->rx_fifo_head != instance->rx_fifo_tail ||
+		!xMessageBufferIsEmpty(instance->rx_packets);
+}
+
+/* Session task: wait up to `timeout` ticks for the receive task to deliver
+ * another frame. Returns early with `false` if a break arrives meanwhile.
+ */
+static bool gdb_wifi_if_fill(struct bmp_wifi_instance *instance, TickType_t timeout)
+{
+	TickType_t start = xTaskGetTickCount();
+
+	do {
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		TickType_t wait = timeout - elapsed;
+		if (wait > pdMS_TO_TICKS(GDB_WIFI_RX_SLICE_MS)) {
+			wait = pdMS_TO_TICKS(GDB_WIFI_RX_SLICE_MS);
+		}
+
+		size_t len = xMessageBufferReceive(instance->rx_packets, instance->rx_fifo, sizeof(instance->rx_fifo), wait);
+		if (len > 0) {
+			instance->rx_fifo_head = 0;
+			instance->rx_fifo_tail = len;
+			return true;
+		}
+		if (instance->rx_closed && xMessageBufferIsEmpty(instance->rx_packets)) {
+			instance->is_shutting_down = true;
+			raise_exception(EXCEPTION_NETWORK, "connection closed");
+			// should not be reached
+			return false;
+		}
+		if (instance->break_pending) {
+			return false;
+		}
+	} while ((xTaskGetTickCount() - start) < timeout);
+
+	return false;
+}
+
+#else /* CONFIG_GDB_SERVER_MULTIPLEXED */
+
+void gdb_wifi_if_start(struct bmp_wifi_instance *instance)
+{
+	gdb_wifi_if_reset(instance);
+}
+
+void gdb_wifi_if_stop(struct bmp_wifi_instance *instance)
+{
+	instance->is_shutting_down = true;
+	shutdown(instance->sock, SHUT_RDWR);
+}
+
+/* Follow the packet framing through one received byte */
+static enum gdb_wifi_rx_state gdb_wifi_if_frame(enum gdb_wifi_rx_state state, uint8_t c)
+{
+	switch (state) {
+	case GDB_WIFI_RX_IDLE:
+		return c == '$' ? GDB_WIFI_RX_PACKET : GDB_WIFI_RX_IDLE;
+	case GDB_WIFI_RX_PACKET:
+		return c == '#' ? GDB_WIFI_RX_CSUM1 : GDB_WIFI_RX_PACKET;
+	case GDB_WIFI_RX_CSUM1:
+		return GDB_WIFI_RX_CSUM2;
+	default:
+		return GDB_WIFI_RX_IDLE;
+	}
+}
+
+/* Whether the receive buffer holds a break or a whole packet, so that
+ * gdb_getpacket() can run without waiting on the network.
+ */
+static bool gdb_wifi_if_scan(const struct bmp_wifi_instance *instance)
+{
+	enum gdb_wifi_rx_state state = GDB_WIFI_RX_IDLE;
+
+	for (uint16_t i = instance->rx_fifo_head; i < instance->rx_fifo_tail; i++) {
+		uint8_t c = instance->rx_fifo[i];
+		if (state == GDB_WIFI_RX_IDLE && (c == '\x03' || c == '\x04')) {
+			return true;
+		}
+		if (state == GDB_WIFI_RX_CSUM2) {
+			return true;
+		}
+		state = gdb_wifi_if_frame(state, c);
+	}
+	return false;
+}
+
+void gdb_wifi_if_pump(struct bmp_wifi_instance *instance)
+{
+	if (instance->rx_fifo_head) {
+		memmove(instance->rx_fifo, instance->rx_fifo + instance->rx_fifo_head,
+			instance->rx_fifo_tail - instance->rx_fifo_head);
+		instance->rx_fifo_tail -= instance->rx_fifo_head;
+		instance->rx_fifo_head = 0;
+	}
+	if (instance->rx_fifo_tail == sizeof(instance->rx_fifo)) {
+		// Leave the rest in the socket until the buffered packet is handled
+		if (gdb_wifi_if_scan(instance)) {
+			return;
+		}
+		// Full and still no whole packet: the client overran the packet size.
+		// Drop it and let gdb_getpacket() resynchronise on the next one.
+		ESP_LOGW("gdb", "dropping oversized packet from %d", instance->sock);
+		instance->rx_fifo_tail = 0;
+	}
+
+	int ret = recv(instance->sock, instance->rx_fifo + instance->rx_fifo_tail,
+		sizeof(instance->rx_fifo) - instance->rx_fifo_tail, MSG_DONTWAIT);
+	if (ret > 0) {
+		instance->rx_fifo_tail += ret;
+		gdb_wifi_rx_bytes += ret;
+		gdb_wifi_rx_calls++;
+	} else if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		instance->rx_closed = true;
+	}
+}
+
+void gdb_wifi_if_pump_break(struct bmp_wifi_instance *instance)
+{
+	gdb_wifi_if_pump(instance);
+
+	enum gdb_wifi_rx_state state = GDB_WIFI_RX_IDLE;
+	for (uint16_t i = instance->rx_fifo_head; i < instance->rx_fifo_tail; i++) {
+		const uint8_t c = instance->rx_fifo[i];
+		if (state == GDB_WIFI_RX_IDLE && c == '\x03') {
+			// Take it out of the stream, as the receive task would have
+			memmove(instance->rx_fifo + i, instance->rx_fifo + i + 1, instance->rx_fifo_tail - i - 1U);
+			instance->rx_fifo_tail--;
+			instance->break_pending = true;
+			return;
+		}
+		state = gdb_wifi_if_frame(state, c);
+	}
+}
+
+bool gdb_wifi_if_ready(struct bmp_wifi_instance *instance)
+{
+	// A closed connection is reported by the next read, so let it run
+	return instance->rx_closed || gdb_wifi_if_scan(instance);
+}
+
+/* Session code wants a byte that hasn't arrived yet. Sessions only run once
+ * a whole packet is buffered, so this is limited to acks, retransmits and
+ * semihosting replies. Wait on this socket alone; the other sessions stall
+ * until it answers.
+ */
+static bool gdb_wifi_if_fill(struct bmp_wifi_instance *instance, TickType_t timeout)
+{
+	while (true) {
+		if (instance->rx_closed) {
+			instance->is_shutting_down = true;
+			raise_exception(EXCEPTION_NETWORK, "connection closed");
+			// should not be reached
+			return false;
+		}
+		if (timeout == 0) {
+			return false;
+		}
+
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(instance->sock, &fds);
+		uint32_t timeout_ms = pdTICKS_TO_MS(timeout);
+		struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+		if (select(instance->sock + 1, &fds, NULL, NULL, (timeout == portMAX_DELAY) ? NULL : &tv) <= 0) {
+			return false;
+		}
+
+		gdb_wifi_if_pump(instance);
+		if (instance->rx_fifo_head != instance->rx_fifo_tail) {
+			return true;
+		}
+	}
+}
+#endif /* CONFIG_GDB_SERVER_MULTIPLEXED */
+
+static unsigned char gdb_wifi_if_getchar(struct bmp_wifi_instance *instance)
+{
+	// A captured reply was never sent, so ack it here
+	if (instance->tx_capture) {
+		return '+';
+	}
+	while (!instance->is_shutting_down) {
+		if (instance->break_pending) {
+			instance->break_pending = false;
+			return '\x03';
+		}
+		if (instance->rx_fifo_head != instance->rx_fifo_tail) {
+			return instance->rx_fifo[instance->rx_fifo_head++];
+		}
+		gdb_wifi_if_fill(instance, portMAX_DELAY);
 	}
-	return tmp;
+	return 0;
 }
 
-static unsigned char gdb_wifi_if_getchar_to(struct gdb_wifi_instance *instance, int timeout)
+static unsigned char gdb_wifi_if_getchar_to(struct bmp_wifi_instance *instance, int timeout)
 {
+	if (instance->tx_capture) {
+		return '+';
+	}
 	if (instance->is_shutting_down) {
 		return 0xff;
 	}
-	// Optimization for "MSG_PEEK"
-	// if (timeout == 0) {
-	// 	uint8_t tmp;
-	// 	int ret = recv(instance->sock, &tmp, 1, MSG_DONTWAIT);
-	// 	if (ret == 1) {
-	// 		return tmp;
-	// 	}
-	// 	return 0xFF;
-	// }
-	fd_set fds;
-	struct timeval tv;
-
-	tv.tv_sec = timeout / 1000;
-	tv.tv_usec = (timeout % 1000) * 1000;
-
-	FD_ZERO(&fds);
-	FD_SET(instance->sock, &fds);
-
-	int ret = select(instance->sock + 1, &fds, NULL, NULL, (timeout >= 0) ? &tv : NULL);
-	if (ret > 0) {
-		char c = gdb_wifi_if_getchar(instance);
-		return c;
+
+	// A break jumps ahead of anything still queued
+	if (instance->break_pending) {
+		instance->break_pending = false;
+		return '\x03';
 	}
 
-	if (ret < 0) {
-		instance->is_shutting_down = true;
-		raise_exception(EXCEPTION_NETWORK, "error on getchar_to");
+	if (instance->rx_fifo_head != instance->rx_fifo_tail) {
+		return instance->rx_fifo[instance->rx_fifo_head++];
+	}
+
+	// A zero timeout is used by the run loop to look for Ctrl-C. This only
+	// checks the message buffer and never touches the network stack.
+	if (timeout == 0) {
+		gdb_wifi_poll_calls++;
+	}
+	if (gdb_wifi_if_fill(instance, (timeout >= 0) ? pdMS_TO_TICKS(timeout) : portMAX_DELAY)) {
+		return instance->rx_fifo[instance->rx_fifo_head++];
+	}
+	if (instance->break_pending) {
+		instance->break_pending = false;
+		return '\x03';
 	}
 	return 0xFF;
 }
 
-static void gdb_wifi_if_putchar(struct gdb_wifi_instance *instance, unsigned char c, int flush)
+/* Hand one or more buffers to lwIP in a single call. Large replies go out as
+ * full TCP segments instead of being split at the transmit buffer size.
+ */
+static void gdb_wifi_if_send(struct bmp_wifi_instance *instance, const struct iovec *iov, int iovcnt)
 {
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	if (total == 0 || instance->sock <= 0) {
+		return;
+	}
+
+	int ret = lwip_writev(instance->sock, iov, iovcnt);
+	if (ret != (int)total) {
+		instance->is_shutting_down = true;
+		raise_exception(EXCEPTION_NETWORK, "error on send");
+		// should not be reached
+		return;
+	}
+	gdb_wifi_tx_bytes += ret;
+	gdb_wifi_tx_calls++;
+}
+
+static void gdb_wifi_if_flush(struct bmp_wifi_instance *instance)
+{
+	struct iovec iov = {.iov_base = instance->tx_buf, .iov_len = instance->tx_bufsize};
+	instance->tx_bufsize = 0;
+	gdb_wifi_if_send(instance, &iov, 1);
+}
+
+static void gdb_wifi_if_putchar(struct bmp_wifi_instance *instance, unsigned char c, int flush)
+{
+	if (instance->tx_capture) {
+		if (instance->tx_capture_len < instance->tx_capture_size) {
+			instance->tx_capture[instance->tx_capture_len++] = c;
+		}
+		return;
+	}
 	if (instance->is_shutting_down) {
 		return;
 	}
 
-	instance->buf[instance->bufsize++] = c;
-	if (flush || (instance->bufsize == sizeof(instance->buf))) {
-		if (instance->sock > 0) {
-			int ret = send(instance->sock, instance->buf, instance->bufsize, 0);
-			if (ret <= 0) {
-				instance->is_shutting_down = true;
-				raise_exception(EXCEPTION_NETWORK, "error on putchar");
-				// should not be reached
-				return;
+	instance->tx_buf[instance->tx_bufsize++] = c;
+	if (flush || (instance->tx_bufsize == sizeof(instance->tx_buf))) {
+		gdb_wifi_if_flush(instance);
+	}
+}
+
+static void gdb_wifi_if_write(struct bmp_wifi_instance *instance, const void *buf, size_t len, int flush)
+{
+	if (instance->is_shutting_down) {
+		return;
+	}
+
+	// Small writes are coalesced into the transmit buffer
+	if (instance->tx_bufsize + len < sizeof(instance->tx_buf)) {
+		memcpy(instance->tx_buf + instance->tx_bufsize, buf, len);
+		instance->tx_bufsize += len;
+		if (flush) {
+			gdb_wifi_if_flush(instance);
+		}
+		return;
+	}
+
+	// Anything larger goes out together with whatever is already pending
+	struct iovec iov[2] = {
+		{.iov_base = instance->tx_buf, .iov_len = instance->tx_bufsize},
+		{.iov_base = (void *)buf, .iov_len = len},
+	};
+	instance->tx_bufsize = 0;
+	gdb_wifi_if_send(instance, iov, 2);
+}
+
+/* Run-length encoding: a character followed by '*' and a count character
+ * stands for the character plus (count - 29) more copies. '#' and '$' can't
+ * be used as counts, and the count must stay printable.
+ */
+#define GDB_RLE_MIN_REPEAT 3
+#define GDB_RLE_MAX_REPEAT ('~' - 29)
+
+static inline void gdb_wifi_if_emit(struct bmp_wifi_instance *instance, char c, uint8_t *csum)
+{
+	if (instance->tx_bufsize == sizeof(instance->tx_buf)) {
+		gdb_wifi_if_flush(instance);
+	}
+	instance->tx_buf[instance->tx_bufsize++] = c;
+	*csum += c;
+}
+
+/* Encode `packet` into the transmit buffer, adding to `csum`. If `binary`
+ * is set, bytes that are special to the protocol are escaped on the way.
+ */
+static void gdb_wifi_if_emit_rle(
+	struct bmp_wifi_instance *instance, const char *packet, size_t len, bool binary, uint8_t *csum_out)
+{
+	uint8_t csum = *csum_out;
+	size_t encoded = 0;
+	size_t i = 0;
+
+	while (i < len) {
+		char c = packet[i];
+
+		if (binary && (c == '#' || c == '$' || c == '}' || c == '*')) {
+			gdb_wifi_if_emit(instance, '}', &csum);
+			gdb_wifi_if_emit(instance, c ^ 0x20, &csum);
+			encoded += 2;
+			i++;
+			continue;
+		}
+
+		// An escaped byte only means something straight after its '}', so
+		// it can never start a run
+		if (!binary && c == '}' && (i + 1) < len) {
+			gdb_wifi_if_emit(instance, c, &csum);
+			gdb_wifi_if_emit(instance, packet[i + 1], &csum);
+			encoded += 2;
+			i += 2;
+			continue;
+		}
+
+		size_t repeat = 0;
+		while ((i + repeat + 1) < len && packet[i + repeat + 1] == c && repeat < GDB_RLE_MAX_REPEAT) {
+			repeat++;
+		}
+		i += repeat + 1;
+
+		gdb_wifi_if_emit(instance, c, &csum);
+		encoded++;
+		if (repeat >= GDB_RLE_MIN_REPEAT) {
+			size_t literal = 0;
+			while ((repeat + 29) == '#' || (repeat + 29) == '$') {
+				repeat--;
+				literal++;
 			}
+			gdb_wifi_if_emit(instance, '*', &csum);
+			gdb_wifi_if_emit(instance, (char)(repeat + 29), &csum);
+			encoded += 2;
+			repeat = literal;
+		}
+		for (; repeat > 0; repeat--) {
+			gdb_wifi_if_emit(instance, c, &csum);
+			encoded++;
+		}
+	}
+
+	if (encoded < len) {
+		gdb_wifi_rle_saved += len - encoded;
+	}
+	*csum_out = csum;
+}
+
+/* Frame and send a packet, or a notification if `start` is '%' */
+static void gdb_wifi_if_putpacket_parts(struct bmp_wifi_instance *instance, char start, const char *hdr,
+	size_t hdr_len, const void *data, size_t len, bool binary)
+{
+	for (int tries = 0; tries < 3; tries++) {
+		if (instance->is_shutting_down) {
+			return;
+		}
+
+		// Encode straight into the transmit buffer, which holds a whole
+		// frame, and send it in a single write.
+		uint8_t csum = 0;
+		instance->tx_buf[instance->tx_bufsize++] = start;
+		gdb_wifi_if_emit_rle(instance, hdr, hdr_len, false, &csum);
+		gdb_wifi_if_emit_rle(instance, data, len, binary, &csum);
+		char trailer[3] = {'#', hex_digit(csum >> 4), hex_digit(csum & 0xf)};
+		gdb_wifi_if_write(instance, trailer, sizeof(trailer), true);
+
+		// Notifications aren't acked
+		if (start == '%' || instance->no_ack_mode || gdb_wifi_if_getchar_to(instance, 2000) == '+') {
+			return;
 		}
-		instance->bufsize = 0;
 	}
 }
 
+void gdb_wifi_if_capture_start(struct bmp_wifi_instance *instance, char *buf, size_t size)
+{
+	instance->tx_capture = buf;
+	instance->tx_capture_len = 0;
+	instance->tx_capture_size = size;
+}
+
+size_t gdb_wifi_if_capture_stop(struct bmp_wifi_instance *instance)
+{
+	instance->tx_capture = NULL;
+	return instance->tx_capture_len;
+}
+
 unsigned char gdb_if_getchar_to(int timeout)
 {
 	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
@@ -155,6 +669,34 @@ void gdb_if_putchar(unsigned char c, int flush)
 	gdb_wifi_if_putchar(ptr[0], c, flush);
 }
 
+void gdb_if_write(const void *buf, size_t len, int flush)
+{
+	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
+	assert(ptr);
+	gdb_wifi_if_write(ptr[0], buf, len, flush);
+}
+
+void gdb_if_putpacket(const char *packet, size_t len)
+{
+	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
+	assert(ptr);
+	gdb_wifi_if_putpacket_parts(ptr[0], '$', NULL, 0, packet, len, false);
+}
+
+void gdb_if_putpacket_binary(const char *hdr, size_t hdr_len, const void *data, size_t len)
+{
+	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
+	assert(ptr);
+	gdb_wifi_if_putpacket_parts(ptr[0], '$', hdr, hdr_len, data, len, true);
+}
+
+void gdb_if_putnotification(const char *packet, size_t len)
+{
+	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
+	assert(ptr);
+	gdb_wifi_if_putpacket_parts(ptr[0], '%', NULL, 0, packet, len, false);
+}
+
 void gdb_target_printf(struct target_controller *tc, const char *fmt, va_list ap)
 {
 	(void)tc;
@@ -7,9 +7,16 @@
 #include <lwip/sockets.h>
 #include <lwip/sys.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
 
 #include "exception.h"
 #include "gdb_if.h"
@@ -21,8 +28,6 @@
 #include "platform.h"
 #include "rtt.h"
 
-static int num_clients;
-
 char *gdb_packet_buffer(void)
 {
 	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
@@ -38,37 +43,132 @@ struct exception **get_innermost_exception(void)
 	return (struct exception **)&ptr[1];
 }
 
-static void gdb_wifi_destroy(struct bmp_wifi_instance *instance)
+uint32_t gdb_session_pool_used;
+uint32_t gdb_session_pool_peak;
+uint32_t gdb_session_pool_rejected;
+
+uint32_t gdb_packet_size;
+uint32_t gdb_poll_count;
+uint32_t gdb_poll_interval_ms;
+uint32_t gdb_halt_latency_us;
+uint32_t gdb_halt_latency_max_us;
+uint32_t gdb_non_stop_notifications;
+
+/* While the target runs it is polled continuously for a short while after
+ * each resume, so that short runs to a breakpoint are reported quickly.
+ * After that the interval between polls doubles up to a ceiling, leaving
+ * the CPU to other tasks. A break from GDB cuts the current sleep short.
+ */
+static void gdb_poll_sched_resume(struct gdb_poll_sched *sched)
 {
-	ESP_LOGI("gdb", "destroy %d", instance->sock);
-	num_clients--;
+	sched->resumed_at = xTaskGetTickCount();
+	sched->interval_ms = 0;
+	gdb_poll_interval_ms = 0;
+}
 
-	close(instance->sock);
+/* Returns how long to wait before the next poll, or 0 to only yield */
+static TickType_t gdb_poll_sched_next(struct gdb_poll_sched *sched)
+{
+	if ((xTaskGetTickCount() - sched->resumed_at) < pdMS_TO_TICKS(CONFIG_GDB_POLL_FAST_PERIOD_MS)) {
+		return 0;
+	}
+
+	if (sched->interval_ms == 0) {
+		// Sleeps are whole ticks, so start the back-off from at least one
+		sched->interval_ms = MAX(CONFIG_GDB_POLL_MIN_INTERVAL_MS, portTICK_PERIOD_MS);
+	} else if (sched->interval_ms < CONFIG_GDB_POLL_MAX_INTERVAL_MS) {
+		sched->interval_ms *= 2;
+		if (sched->interval_ms > CONFIG_GDB_POLL_MAX_INTERVAL_MS) {
+			sched->interval_ms = CONFIG_GDB_POLL_MAX_INTERVAL_MS;
+		}
+	}
+	gdb_poll_interval_ms = sched->interval_ms;
 
-	TaskHandle_t pid = instance->pid;
-	free(instance);
-	vTaskDelete(pid);
+	TickType_t ticks = pdMS_TO_TICKS(sched->interval_ms);
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	return ticks;
 }
 
-#define MAYBE_SLEEP(last, current)                                                                  \
-	do {                                                                                            \
-		current = xTaskGetTickCount();                                                              \
-		if ((current - last) > pdMS_TO_TICKS(500)) {                                                \
-			/*ESP_LOGI("bmp", "delaying because last delay was %ld ticks ago", (current - last));*/ \
-			last = current;                                                                         \
-			vTaskDelay(2);                                                                          \
-		}                                                                                           \
-	} while (0)
+/* Attach a packet buffer to a session that doesn't have one yet */
+static void gdb_wifi_session_alloc(struct bmp_wifi_instance *instance)
+{
+#if CONFIG_GDB_LARGE_PACKETS
+	instance->rx_buf_size = CONFIG_GDB_LARGE_PACKET_SIZE + 1;
+	instance->rx_buf = heap_caps_malloc(instance->rx_buf_size, MALLOC_CAP_SPIRAM);
+	if (!instance->rx_buf) {
+		ESP_LOGW("gdb", "no PSRAM for a %d byte packet buffer -- using %d bytes", CONFIG_GDB_LARGE_PACKET_SIZE,
+			GDB_PACKET_BUFFER_SIZE);
+		instance->rx_buf_size = GDB_PACKET_BUFFER_SIZE + 1;
+		instance->rx_buf = heap_caps_malloc(instance->rx_buf_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+		assert(instance->rx_buf);
+	}
+#else
+	instance->rx_buf = instance->rx_buf_storage;
+	instance->rx_buf_size = sizeof(instance->rx_buf_storage);
+#endif
+	gdb_packet_size = instance->rx_buf_size - 1;
+}
 
-static void gdb_wifi_task(void *arg)
+/* How long a parked target may take to halt for the session taking it over */
+#define GDB_UNPARK_HALT_TIMEOUT_US 1000000
+
+void gdb_target_state_clear(void)
 {
-	struct bmp_wifi_instance *instance = (struct bmp_wifi_instance *)arg;
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+	gdb_breakpoint_clear();
+#endif
+#if CONFIG_GDB_TRACEPOINTS
+	gdb_trace_clear();
+#endif
+#if CONFIG_GDB_RTOS_THREADS
+	gdb_rtos_clear();
+#endif
+}
 
-	void *tls[2] = {};
-	tls[0] = arg;
-	vTaskSetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX, tls); // used for exception handling
+void gdb_target_free(void)
+{
+	target_list_free();
+#if CONFIG_GDB_SCAN_CACHE
+	gdb_scan_cache_invalidate();
+#endif
+	gdb_memcache_invalidate();
+	gdb_regcache_invalidate();
+#if CONFIG_GDB_INCREMENTAL_FLASH
+	gdb_flash_abort();
+#endif
+	gdb_target_state_clear();
+}
 
-	ESP_LOGI("gdb", "Started task %d this:%p tlsp:%p", instance->sock, instance, tls);
+void gdb_target_take_over(void)
+{
+	gdb_memcache_invalidate();
+	gdb_regcache_invalidate();
+	if (cur_target && gdb_target_running) {
+		volatile target_halt_reason_e reason = TARGET_HALT_ERROR;
+		volatile struct exception e;
+		TRY_CATCH (e, EXCEPTION_ALL) {
+			const int64_t deadline = esp_timer_get_time() + GDB_UNPARK_HALT_TIMEOUT_US;
+			target_addr_t watch = 0;
+			target_halt_request(cur_target);
+			while ((reason = target_halt_poll(cur_target, &watch)) == TARGET_HALT_RUNNING &&
+				esp_timer_get_time() < deadline) {
+				vTaskDelay(1);
+			}
+		}
+		gdb_target_running = false;
+		SET_RUN_STATE(0);
+		if (e.type || reason == TARGET_HALT_RUNNING || reason == TARGET_HALT_ERROR) {
+			ESP_LOGW("gdb", "parked target didn't halt -- freeing it");
+			gdb_target_free();
+		}
+	}
+}
+
+static void gdb_wifi_session_start(struct bmp_wifi_instance *instance)
+{
+	ESP_LOGI("gdb", "Started session %d this:%p", instance->sock, instance);
 
 	int opt = 1;
 	setsockopt(instance->sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
@@ -80,74 +180,533 @@ static void gdb_wifi_task(void *arg)
 	setsockopt(instance->sock, IPPROTO_TCP, TCP_KEEPINTVL, (void *)&opt, sizeof(opt));
 	opt = 3; /* TCP_KEEPCNT */
 	setsockopt(instance->sock, IPPROTO_TCP, TCP_KEEPCNT, (void *)&opt, sizeof(opt));
-	opt = 1;
 
-	num_clients++;
+	instance->halt_requested_at = 0;
+	gdb_poll_sched_resume(&instance->poll_sched);
+	gdb_wifi_if_start(instance);
+}
+
+static void gdb_wifi_session_end(struct bmp_wifi_instance *instance)
+{
+	ESP_LOGI("gdb", "destroy %d", instance->sock);
 
-	char *pbuf = instance->rx_buf;
+	gdb_wifi_if_stop(instance);
+	close(instance->sock);
+	instance->sock = -1;
+}
 
-	TickType_t last_sleep = xTaskGetTickCount();
-	TickType_t current_sleep = last_sleep;
-	while (true) {
-		volatile struct exception e;
-		TRY_CATCH (e, EXCEPTION_ALL) {
-			SET_IDLE_STATE(0);
-			while (gdb_target_running && cur_target) {
-				gdb_poll_target();
-
-				// Check again, as `gdb_poll_target()` may
-				// alter these variables.
-				if (!gdb_target_running || !cur_target) {
-					break;
-				}
-				char c = (char)gdb_if_getchar_to(0);
-				if (c == '\x03' || c == '\x04') {
-					target_halt_request(cur_target);
-				}
-				MAYBE_SLEEP(last_sleep, current_sleep);
-				if (rtt_enabled)
-					poll_rtt(cur_target);
+#define GDB_SIGNONE 0
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+#define GDB_SIGSEGV 11
+#define GDB_SIGLOST 29
+
+static struct bmp_wifi_instance *gdb_wifi_current_instance(void)
+{
+	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
+	assert(ptr);
+	return ptr[0];
+}
+
+/* Format a stop reply. In non-stop mode it always names the thread, and a
+ * halt can only have been asked for with 'vCont;t', which GDB expects to be
+ * reported as signal 0.
+ */
+static int gdb_stop_reply_format(
+	target_s *t, target_halt_reason_e reason, target_addr_t watch, bool non_stop, char *reply, size_t size)
+{
+	int len;
+
+	switch (reason) {
+	case TARGET_HALT_ERROR:
+		return snprintf(reply, size, "X%02X", GDB_SIGLOST);
+	case TARGET_HALT_REQUEST:
+		len = snprintf(reply, size, "T%02X", non_stop ? GDB_SIGNONE : GDB_SIGINT);
+		break;
+	case TARGET_HALT_WATCHPOINT:
+		len = snprintf(reply, size, "T%02Xwatch:%08" PRIX32 ";", GDB_SIGTRAP, watch);
+		break;
+	case TARGET_HALT_FAULT:
+		len = snprintf(reply, size, "T%02X", GDB_SIGSEGV);
+		break;
+	default:
+		len = snprintf(reply, size, "T%02X", GDB_SIGTRAP);
+		break;
+	}
+	if (non_stop) {
+		len += snprintf(reply + len, size - len, "thread:1;");
+	}
+#if CONFIG_GDB_RTOS_THREADS
+	const uint32_t thread = non_stop ? 0 : gdb_rtos_current_thread(t);
+	if (thread) {
+		len += snprintf(reply + len, size - len, "thread:%" PRIx32 ";", thread);
+	}
+#else
+	(void)t;
+#endif
+	return len;
+}
+
+void gdb_stop_reply(target_s *t, target_halt_reason_e reason, target_addr_t watch)
+{
+	char reply[64];
+
+	if (gdb_wifi_current_instance()->non_stop) {
+		const int len = snprintf(reply, sizeof(reply), "Stop:");
+		gdb_stop_reply_format(t, reason, watch, true, reply + len, sizeof(reply) - len);
+		gdb_if_putnotification(reply, strlen(reply));
+		gdb_non_stop_notifications++;
+	} else {
+		gdb_stop_reply_format(t, reason, watch, false, reply, sizeof(reply));
+		gdb_putpacketz(reply);
+	}
+	if (reason != TARGET_HALT_ERROR) {
+		gdb_memcache_prefetch_halt(t);
+	}
+}
+
+void gdb_non_stop_status(target_s *t)
+{
+	char reply[64];
+
+	if (gdb_target_running) {
+		gdb_putpacketz("OK");
+		return;
+	}
+	gdb_stop_reply_format(t, TARGET_HALT_BREAKPOINT, 0, true, reply, sizeof(reply));
+	gdb_putpacketz(reply);
+}
+
+/* Poll the target once if this session has it running. Returns `true` if it
+ * is still running and should be polled again.
+ */
+static bool gdb_wifi_session_poll(struct bmp_wifi_instance *instance)
+{
+	if (!gdb_target_running || !cur_target || !gdb_target_is_owner(instance)) {
+		return false;
+	}
+
+	gdb_target_lock(instance);
+	// Stops in non-stop mode are notifications, which only farpatch sends
+	if (instance->non_stop || gdb_breakpoint_active(cur_target)) {
+		gdb_breakpoint_poll(cur_target);
+	} else {
+		gdb_poll_target();
+	}
+	gdb_poll_count++;
+
+	// Check again, as `gdb_poll_target()` may
+	// alter these variables.
+	bool halted = !gdb_target_running || !cur_target;
+	if (!halted) {
+		// In non-stop mode GDB keeps sending packets, which are left for
+		// gdb_wifi_session_packet(). Only an out-of-band break is taken here.
+		char c = 0;
+		if (!instance->non_stop) {
+			c = (char)gdb_if_getchar_to(0);
+		} else if (instance->break_pending) {
+			instance->break_pending = false;
+			c = '\x03';
+		}
+		if (c == '\x03' || c == '\x04') {
+			// Measure from when the receive task saw the break, if it did
+			instance->halt_requested_at = instance->break_at_us ? instance->break_at_us : esp_timer_get_time();
+			instance->break_at_us = 0;
+			target_halt_request(cur_target);
+			// Poll again straight away to pick up the halt
+			gdb_poll_sched_resume(&instance->poll_sched);
+		}
+		if (rtt_enabled)
+			poll_rtt(cur_target);
+	} else if (cur_target) {
+		gdb_memcache_prefetch_halt(cur_target);
+	}
+	gdb_target_unlock(instance);
+
+	if (halted) {
+		if (instance->halt_requested_at) {
+			gdb_halt_latency_us = esp_timer_get_time() - instance->halt_requested_at;
+			if (gdb_halt_latency_us > gdb_halt_latency_max_us) {
+				gdb_halt_latency_max_us = gdb_halt_latency_us;
 			}
+			instance->halt_requested_at = 0;
+		}
+		return false;
+	}
+	return true;
+}
 
-			SET_IDLE_STATE(1);
-			size_t size = gdb_getpacket(pbuf, GDB_PACKET_BUFFER_SIZE);
-			// If port closed and target detached, stay idle
-			if ((pbuf[0] != 0x04) || cur_target) {
-				SET_IDLE_STATE(0);
+/* Read one packet and answer it */
+static void gdb_wifi_session_packet(struct bmp_wifi_instance *instance)
+{
+	char *pbuf = instance->rx_buf;
+
+	SET_IDLE_STATE(1);
+	size_t size = gdb_getpacket(pbuf, instance->rx_buf_size - 1);
+	// If port closed and target detached, stay idle
+	if ((pbuf[0] != 0x04) || cur_target) {
+		SET_IDLE_STATE(0);
+	}
+	instance->answering = true;
+	const bool was_running = gdb_target_running;
+	// The reply overwrites `pbuf`, so note now whether this detaches
+	bool detaching = (pbuf[0] == 'D') || (pbuf[0] == '\x04') || (pbuf[0] == 'k') || !strcmp(pbuf, "vKill;1");
+	gdb_target_lock(instance);
+	if (!gdb_fastpath_handle(instance, pbuf, instance->rx_buf_size, size)) {
+		gdb_main(pbuf, instance->rx_buf_size, size);
+	}
+	gdb_target_unlock(instance);
+	instance->answering = false;
+	if (detaching && gdb_target_is_owner(instance)) {
+		gdb_target_state_clear();
+		gdb_target_release(instance);
+	}
+	// Poll at once after a resume, or after 'vCont;t' asked for a halt
+	if (gdb_target_running && (!was_running || instance->halt_requested_at)) {
+		gdb_poll_sched_resume(&instance->poll_sched);
+	}
+}
+
+/* Whether a packet should be answered although the target is running */
+static bool gdb_wifi_session_non_stop_ready(struct bmp_wifi_instance *instance)
+{
+	return instance->non_stop && gdb_wifi_if_ready(instance);
+}
+
+/* Clean up after an exception escaped a session. Returns `false` if the
+ * session is over.
+ */
+static bool gdb_wifi_session_exception(struct bmp_wifi_instance *instance, volatile struct exception *e)
+{
+	gdb_target_unlock(instance);
+	gdb_wifi_if_capture_stop(instance);
+	const bool answering = instance->answering;
+	instance->answering = false;
+	if (e->type == EXCEPTION_NETWORK) {
+		ESP_LOGE("exception", "network exception -- exiting: %s", e->msg);
+		// Only the owner's target state goes away with it, and only once the
+		// grace period for a reconnect is over
+		bool park = false;
+		if (gdb_target_is_owner(instance)) {
+			gdb_target_lock_timeout(instance, portMAX_DELAY);
+			park = CONFIG_GDB_RECONNECT_GRACE_MS > 0 && cur_target;
+			if (park) {
+				gdb_memcache_invalidate();
+				gdb_regcache_invalidate();
+#if CONFIG_GDB_INCREMENTAL_FLASH
+				gdb_flash_abort();
+#endif
+			} else {
+				gdb_target_free();
 			}
-			gdb_main(pbuf, sizeof(instance->rx_buf), size);
-			MAYBE_SLEEP(last_sleep, current_sleep);
+			gdb_target_unlock(instance);
 		}
-		if (e.type == EXCEPTION_NETWORK) {
-			ESP_LOGE("exception", "network exception -- exiting: %s", e.msg);
-			target_list_free();
-			break;
+		if (park) {
+			gdb_target_park(instance);
+		} else {
+			gdb_target_release(instance);
 		}
-		if (e.type) {
+		return false;
+	}
+	if (e->type == EXCEPTION_MUTEX) {
+		ESP_LOGE("exception", "%s", e->msg);
+		// A poll that timed out is simply tried again. GDB only expects an
+		// error in place of a reply.
+		if (answering) {
 			gdb_putpacketz("EFF");
-			target_list_free();
+		}
+		return true;
+	}
+	if (e->type) {
+		gdb_putpacketz("EFF");
+		if (gdb_target_is_owner(instance)) {
+			gdb_target_lock_timeout(instance, portMAX_DELAY);
+			gdb_target_free();
+			gdb_target_unlock(instance);
 			morse("TARGET LOST.", 1);
 		}
 	}
+	return true;
+}
+
+#if !CONFIG_GDB_SERVER_MULTIPLEXED
+/* GDB sessions come from a fixed pool that is allocated at boot. Each slot
+ * has its own session and receive tasks, which park between connections,
+ * so accepting a connection never touches the heap or creates a task.
+ */
+#define GDB_SESSION_STACK_SIZE 12000
+#define GDB_WIFI_RX_STACK_SIZE 3072
+
+static struct bmp_wifi_instance gdb_sessions[CONFIG_GDB_SESSION_POOL_SIZE];
+static StackType_t gdb_session_stacks[CONFIG_GDB_SESSION_POOL_SIZE][GDB_SESSION_STACK_SIZE];
+static StaticTask_t gdb_session_tasks[CONFIG_GDB_SESSION_POOL_SIZE];
+static StackType_t gdb_wifi_rx_stacks[CONFIG_GDB_SESSION_POOL_SIZE][GDB_WIFI_RX_STACK_SIZE];
+static StaticTask_t gdb_wifi_rx_tasks[CONFIG_GDB_SESSION_POOL_SIZE];
 
-	gdb_wifi_destroy(instance);
+static QueueHandle_t gdb_session_queue;
+static StaticQueue_t gdb_session_queue_buffer;
+static uint8_t gdb_session_queue_storage[CONFIG_GDB_SESSION_POOL_SIZE * sizeof(int)];
+static portMUX_TYPE gdb_session_pool_spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool gdb_session_pool_acquire(void)
+{
+	bool acquired = false;
+
+	taskENTER_CRITICAL(&gdb_session_pool_spinlock);
+	if (gdb_session_pool_used < CONFIG_GDB_SESSION_POOL_SIZE) {
+		gdb_session_pool_used++;
+		if (gdb_session_pool_used > gdb_session_pool_peak) {
+			gdb_session_pool_peak = gdb_session_pool_used;
+		}
+		acquired = true;
+	} else {
+		gdb_session_pool_rejected++;
+	}
+	taskEXIT_CRITICAL(&gdb_session_pool_spinlock);
+	return acquired;
 }
 
-static void new_bmp_wifi_instance(int sock)
+static void gdb_session_pool_release(void)
 {
-	char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];
-	snprintf(name, sizeof(name) - 1, "gdbc fd:%" PRId16, sock);
+	taskENTER_CRITICAL(&gdb_session_pool_spinlock);
+	gdb_session_pool_used--;
+	taskEXIT_CRITICAL(&gdb_session_pool_spinlock);
+}
+
+static void gdb_wifi_task(void *arg)
+{
+	struct bmp_wifi_instance *instance = (struct bmp_wifi_instance *)arg;
+
+	void *tls[2] = {};
+	tls[0] = arg;
+	vTaskSetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX, tls); // used for exception handling
+
+	while (true) {
+		int sock;
+		// Idle sessions also free a parked target nobody came back for
+		if (xQueueReceive(gdb_session_queue, &sock, gdb_target_parked_ticks()) != pdTRUE) {
+			gdb_target_park_expire();
+			continue;
+		}
+
+		instance->sock = sock;
+		tls[1] = NULL;
+		gdb_wifi_session_start(instance);
+
+		while (true) {
+			volatile struct exception e;
+			TRY_CATCH (e, EXCEPTION_ALL) {
+				SET_IDLE_STATE(0);
+				while (gdb_wifi_session_poll(instance) && !gdb_wifi_session_non_stop_ready(instance)) {
+					TickType_t ticks = gdb_poll_sched_next(&instance->poll_sched);
+					if (ticks == 0) {
+						taskYIELD();
+					} else {
+						// The receive task notifies this task when a break arrives
+						ulTaskNotifyTake(pdTRUE, ticks);
+					}
+				}
+				gdb_wifi_session_packet(instance);
+			}
+			if (!gdb_wifi_session_exception(instance, &e)) {
+				break;
+			}
+		}
+
+		gdb_wifi_session_end(instance);
+		gdb_session_pool_release();
+	}
+}
+
+static void gdb_server_init(void)
+{
+	gdb_session_queue = xQueueCreateStatic(CONFIG_GDB_SESSION_POOL_SIZE, sizeof(int), gdb_session_queue_storage,
+		&gdb_session_queue_buffer);
+	assert(gdb_session_queue);
+
+	for (int i = 0; i < CONFIG_GDB_SESSION_POOL_SIZE; i++) {
+		char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];
+		struct bmp_wifi_instance *instance = &gdb_sessions[i];
+
+		instance->sock = -1;
+		gdb_wifi_session_alloc(instance);
+		snprintf(name, sizeof(name) - 1, "gdbc %d", i);
+		instance->pid = xTaskCreateStatic(gdb_wifi_task, name, GDB_SESSION_STACK_SIZE, (void *)instance,
+			tskIDLE_PRIORITY + 1, gdb_session_stacks[i], &gdb_session_tasks[i]);
+		gdb_wifi_if_init(instance, i, gdb_wifi_rx_stacks[i], GDB_WIFI_RX_STACK_SIZE, &gdb_wifi_rx_tasks[i]);
+	}
+}
+
+static void gdb_server_run(int gdb_if_serv)
+{
+	while (1) {
+		int s = accept(gdb_if_serv, NULL, NULL);
+		if (s > 0) {
+			if (!gdb_session_pool_acquire()) {
+				ESP_LOGE("gdb", "all %d sessions are in use -- rejecting connection", CONFIG_GDB_SESSION_POOL_SIZE);
+				close(s);
+				continue;
+			}
+			xQueueSend(gdb_session_queue, &s, portMAX_DELAY);
+		}
+	}
+}
+
+#else /* CONFIG_GDB_SERVER_MULTIPLEXED */
+/* Every session is served by this one task. Sessions are allocated per
+ * connection and cost little more than their packet buffers, so the number
+ * of clients is limited by heap and sockets rather than task stacks.
+ *
+ * This is cooperative run-to-completion scheduling, not an event-driven
+ * server. A session is only run once a whole packet or a break has arrived,
+ * and it runs that packet to completion. Exceptions therefore never cross
+ * from one session to another, and the task-local exception state is simply
+ * pointed at whichever session is being run. The price is that whatever a
+ * packet waits on stalls every session: acks, flash programming, range
+ * steps, CRC stub runs and halting a target taken over after a reconnect.
+ */
+static struct bmp_wifi_instance *gdb_mux_sessions;
+static void *gdb_mux_tls[2];
+
+static void gdb_server_init(void)
+{
+	vTaskSetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX, gdb_mux_tls); // used for exception handling
+}
+
+static void gdb_mux_accept(int gdb_if_serv)
+{
+	int s = accept(gdb_if_serv, NULL, NULL);
+	if (s <= 0) {
+		return;
+	}
 
 	struct bmp_wifi_instance *instance = malloc(sizeof(struct bmp_wifi_instance));
 	if (!instance) {
+		ESP_LOGE("gdb", "out of memory -- rejecting connection");
+		gdb_session_pool_rejected++;
+		close(s);
 		return;
 	}
-
 	memset(instance, 0, sizeof(*instance));
-	instance->sock = sock;
+	gdb_wifi_session_alloc(instance);
+	instance->sock = s;
+	instance->pid = xTaskGetCurrentTaskHandle();
+	gdb_wifi_session_start(instance);
+
+	instance->mux_next = gdb_mux_sessions;
+	gdb_mux_sessions = instance;
+	gdb_session_pool_used++;
+	if (gdb_session_pool_used > gdb_session_pool_peak) {
+		gdb_session_pool_peak = gdb_session_pool_used;
+	}
+}
+
+/* Give one session a turn: poll its running target, or answer one packet.
+ * Either runs to completion before the next session gets a turn. Returns
+ * `false` once the session is over.
+ */
+static bool gdb_mux_step(struct bmp_wifi_instance *instance, bool *polling)
+{
+	gdb_mux_tls[0] = instance;
+	gdb_mux_tls[1] = NULL;
+
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		SET_IDLE_STATE(0);
+		if (gdb_wifi_session_poll(instance)) {
+			*polling = true;
+			if (gdb_wifi_session_non_stop_ready(instance)) {
+				gdb_wifi_session_packet(instance);
+			}
+		} else if (gdb_wifi_if_ready(instance)) {
+			gdb_wifi_session_packet(instance);
+		}
+	}
+	return gdb_wifi_session_exception(instance, &e);
+}
+
+static void gdb_server_run(int gdb_if_serv)
+{
+	struct gdb_poll_sched *sched = NULL;
+
+	while (1) {
+		fd_set fds;
+		int max_fd = gdb_if_serv;
+		bool ready = false;
+
+		FD_ZERO(&fds);
+		FD_SET(gdb_if_serv, &fds);
+		for (struct bmp_wifi_instance *instance = gdb_mux_sessions; instance; instance = instance->mux_next) {
+			FD_SET(instance->sock, &fds);
+			if (instance->sock > max_fd) {
+				max_fd = instance->sock;
+			}
+			// A packet may be left over from the last pass
+			if (gdb_wifi_if_ready(instance)) {
+				ready = true;
+			}
+		}
+
+		// Only the owner of the target can have it running, so there is at
+		// most one schedule to follow.
+		struct timeval tv = {0};
+		struct timeval *timeout = NULL;
+		if (ready) {
+			timeout = &tv;
+		} else if (sched) {
+			TickType_t ticks = gdb_poll_sched_next(sched);
+			uint32_t timeout_ms = pdTICKS_TO_MS(ticks);
+			tv.tv_sec = timeout_ms / 1000;
+			tv.tv_usec = (timeout_ms % 1000) * 1000;
+			timeout = &tv;
+			if (ticks == 0) {
+				taskYIELD();
+			}
+		}
+		// A parked target has no owner, so nothing else sets a timeout. Wake up
+		// to free it if nobody comes back for it.
+		const TickType_t parked_ticks = gdb_target_parked_ticks();
+		if (!timeout && parked_ticks != portMAX_DELAY) {
+			const uint32_t parked_ms = pdTICKS_TO_MS(parked_ticks);
+			tv.tv_sec = parked_ms / 1000;
+			tv.tv_usec = (parked_ms % 1000) * 1000;
+			timeout = &tv;
+		}
+
+		if (select(max_fd + 1, &fds, NULL, NULL, timeout) > 0) {
+			if (FD_ISSET(gdb_if_serv, &fds)) {
+				gdb_mux_accept(gdb_if_serv);
+			}
+			for (struct bmp_wifi_instance *instance = gdb_mux_sessions; instance; instance = instance->mux_next) {
+				if (FD_ISSET(instance->sock, &fds)) {
+					gdb_wifi_if_pump(instance);
+				}
+			}
+		}
 
-	xTaskCreate(gdb_wifi_task, name, 12000, (void *)instance, tskIDLE_PRIORITY + 1, &instance->pid);
+		gdb_target_park_expire();
+
+		sched = NULL;
+		struct bmp_wifi_instance **link = &gdb_mux_sessions;
+		while (*link) {
+			struct bmp_wifi_instance *instance = *link;
+			bool polling = false;
+			if (gdb_mux_step(instance, &polling)) {
+				if (polling) {
+					sched = &instance->poll_sched;
+				}
+				link = &instance->mux_next;
+				continue;
+			}
+
+			*link = instance->mux_next;
+			gdb_wifi_session_end(instance);
+			free(instance);
+			gdb_session_pool_used--;
+		}
+	}
 }
+#endif /* CONFIG_GDB_SERVER_MULTIPLEXED */
 
 void gdb_net_task(void *arg)
 {
@@ -168,11 +727,7 @@ void gdb_net_task(void *arg)
 	assert(listen(gdb_if_serv, 1) != -1);
 
 	ESP_LOGI("gdb", "Listening on TCP:%d", CONFIG_TCP_PORT);
-
-	while (1) {
-		int s = accept(gdb_if_serv, NULL, NULL);
-		if (s > 0) {
-			new_bmp_wifi_instance(s);
-		}
-	}
+	gdb_target_lock_init();
+	gdb_server_init();
+	gdb_server_run(gdb_if_serv);
 }
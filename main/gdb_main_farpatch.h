@@ -2,24 +2,327 @@
 #define GDB_MAIN_FARPATCH_H_
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/message_buffer.h>
 #include <gdb_main.h>
+#include <target.h>
 
 #define EXCEPTION_NETWORK 0x40
 #define EXCEPTION_MUTEX   0x41
 
 #define GDB_TLS_INDEX 1
 
+/* A full packet buffer plus the '$', '#' and two checksum characters. This
+ * is the largest frame the receive task passes to the session task in one
+ * piece, and the transmit buffer is sized to send one in a single write.
+ */
+#define GDB_WIFI_FRAME_SIZE (GDB_PACKET_BUFFER_SIZE + 4)
+
+/* Room for two complete frames, each with its message buffer length prefix */
+#define GDB_WIFI_RX_MSGBUF_SIZE (2 * (GDB_WIFI_FRAME_SIZE + sizeof(size_t)))
+
+/* How often a blocked reader rechecks for a break or a closed connection */
+#define GDB_WIFI_RX_SLICE_MS 100
+
+/* While the target runs, how soon it is polled again. See gdb_main.c. */
+struct gdb_poll_sched {
+	TickType_t resumed_at;
+	uint32_t interval_ms;
+};
+
 struct bmp_wifi_instance {
 	int sock;
 	int tx_bufsize;
-	int unget;
-	int index;
 	TaskHandle_t pid;
 	bool no_ack_mode;
-	bool is_shutting_down;
-	uint8_t tx_buf[1024];
-	int rx_buf_index;
-	char rx_buf[GDB_PACKET_BUFFER_SIZE + 1];
+	volatile bool is_shutting_down;
+	volatile bool break_pending;
+	volatile bool rx_closed;
+	volatile int64_t break_at_us;
+	bool holds_target_lock;
+	bool flash_write_failed;
+	/* Thread picked with 'Hg', or 0 for the running one */
+	uint32_t rtos_thread;
+	/* GDB asked for non-stop mode with 'QNonStop:1' */
+	bool non_stop;
+	/* A packet is being answered, so an error reply is expected */
+	bool answering;
+	struct bmp_wifi_instance *owner_queue_next;
+	struct gdb_poll_sched poll_sched;
+	int64_t halt_requested_at;
+	uint8_t tx_buf[GDB_WIFI_FRAME_SIZE];
+
+	/* While set, gdb_if_putchar() output is collected here instead of sent */
+	char *tx_capture;
+	uint16_t tx_capture_len;
+	uint16_t tx_capture_size;
+
+	/* Frame currently being consumed by gdb_if_getchar(). In multiplexed
+	 * mode this holds raw bytes straight from the socket instead.
+	 */
+	uint16_t rx_fifo_head;
+	uint16_t rx_fifo_tail;
+	uint8_t rx_fifo[GDB_WIFI_FRAME_SIZE];
+
+	/* Packet buffer. Points at `rx_buf_storage` unless large packets are
+	 * enabled, in which case it is allocated from PSRAM.
+	 */
+	char *rx_buf;
+	size_t rx_buf_size;
+#if !CONFIG_GDB_LARGE_PACKETS
+	char rx_buf_storage[GDB_PACKET_BUFFER_SIZE + 1];
+#endif
+
+#if CONFIG_GDB_SERVER_MULTIPLEXED
+	struct bmp_wifi_instance *mux_next;
+#else
+	TaskHandle_t rx_pid;
+	MessageBufferHandle_t rx_packets;
+	volatile bool rx_task_running;
+
+	/* Owned by the receive task */
+	uint8_t rx_frame_state;
+	uint16_t rx_frame_len;
+	uint8_t rx_frame[GDB_WIFI_FRAME_SIZE];
+	uint8_t rx_net[1460];
+
+	StaticMessageBuffer_t rx_packets_buffer;
+	uint8_t rx_packets_storage[GDB_WIFI_RX_MSGBUF_SIZE + 1];
+#endif
 };
 
+/* Whether a whole packet or a closed connection is waiting, so that
+ * reading the next packet won't block.
+ */
+bool gdb_wifi_if_ready(struct bmp_wifi_instance *instance);
+
+#if CONFIG_GDB_SERVER_MULTIPLEXED
+/* Multiplexed server: one task owns every socket. gdb_wifi_if_pump() reads
+ * whatever has arrived without blocking, so that a session is only run once
+ * gdb_wifi_if_ready(). Reading its packet then doesn't wait on the network,
+ * although answering it may.
+ */
+void gdb_wifi_if_pump(struct bmp_wifi_instance *instance);
+/* Pump, and turn a break that arrived between packets into `break_pending`.
+ * For long operations run on behalf of a packet that has been read in full.
+ */
+void gdb_wifi_if_pump_break(struct bmp_wifi_instance *instance);
+#else
+/* The per-session receive task reads the socket and frames RSP packets for
+ * the session task. It is created once per pool slot by gdb_wifi_if_init()
+ * and parked between connections.
+ */
+void gdb_wifi_if_init(struct bmp_wifi_instance *instance, int slot, StackType_t *rx_stack, uint32_t rx_stack_size,
+	StaticTask_t *rx_task);
+#endif
+void gdb_wifi_if_start(struct bmp_wifi_instance *instance);
+void gdb_wifi_if_stop(struct bmp_wifi_instance *instance);
+
+/* Collect the reply blackmagic writes through gdb_if_putchar() so that it
+ * can be rewritten before it is sent. Acks are faked while capturing.
+ */
+void gdb_wifi_if_capture_start(struct bmp_wifi_instance *instance, char *buf, size_t size);
+size_t gdb_wifi_if_capture_stop(struct bmp_wifi_instance *instance);
+
+/* Serialise access to the debug port between sessions. gdb_target_lock()
+ * raises EXCEPTION_MUTEX if the target stays busy for too long.
+ */
+void gdb_target_lock_init(void);
+void gdb_target_lock(struct bmp_wifi_instance *instance);
+bool gdb_target_lock_timeout(struct bmp_wifi_instance *instance, TickType_t ticks);
+void gdb_target_unlock(struct bmp_wifi_instance *instance);
+
+/* Target ownership. gdb_target_claim() returns 0 if `instance` owns the
+ * target, otherwise its position in the queue of sessions waiting for it.
+ * The caller holds the target lock, as claiming a parked target halts it.
+ */
+int gdb_target_claim(struct bmp_wifi_instance *instance);
+void gdb_target_release(struct bmp_wifi_instance *instance);
+bool gdb_target_is_owner(const struct bmp_wifi_instance *instance);
+bool gdb_target_has_owner(void);
+
+/* Keeping the target across a reconnect. gdb_target_park() releases the
+ * target but keeps it attached. The next gdb_target_claim() takes it over
+ * and calls gdb_target_take_over(), which halts it if it was left running,
+ * as attaching would have. gdb_target_park_expire() frees it once the grace
+ * period is over. gdb_target_parked_ticks() is how long until then, or
+ * portMAX_DELAY if nothing is parked.
+ */
+void gdb_target_park(struct bmp_wifi_instance *instance);
+void gdb_target_take_over(void);
+TickType_t gdb_target_parked_ticks(void);
+void gdb_target_park_expire(void);
+
+/* Free the target list and everything kept about the target. The caller
+ * holds the target lock.
+ */
+void gdb_target_free(void);
+
+/* Forget the breakpoints, tracepoints and threads kept for the target, when
+ * it is detached, attached again or replaced by a scan. The next target may
+ * well get the same `target_s`, so the pointer alone can't tell.
+ */
+void gdb_target_state_clear(void);
+
+/* Answer packets that farpatch serves itself. Returns `false` if the packet
+ * should be passed on to gdb_main().
+ */
+bool gdb_fastpath_handle(struct bmp_wifi_instance *instance, char *pbuf, size_t pbuf_size, size_t size);
+
+/* Cache of target memory, valid while the target stays halted. Reads return
+ * `true` on error, like target_mem_read().
+ */
+bool gdb_memcache_read(target_s *t, void *dest, uint32_t addr, size_t len);
+void gdb_memcache_invalidate(void);
+bool gdb_memcache_command(int argc, const char **argv);
+
+/* Warm both caches with what GDB reads after a stop: the registers and the
+ * memory around SP and LR.
+ */
+void gdb_memcache_prefetch_halt(target_s *t);
+bool gdb_prefetch_command(int argc, const char **argv);
+
+/* Cache of the target's registers, valid while the target stays halted */
+void gdb_regcache_regs_read(target_s *t, void *data, size_t size);
+void gdb_regcache_regs_write(target_s *t, const void *data, size_t size);
+size_t gdb_regcache_reg_read(target_s *t, uint32_t reg, void *data, size_t max);
+size_t gdb_regcache_reg_write(target_s *t, uint32_t reg, const void *data, size_t size);
+void gdb_regcache_invalidate(void);
+
+/* GDB's number for the PC register of `t`, or -1 if the core isn't known */
+int gdb_regcache_pc_reg(target_s *t);
+
+/* Report that the target stopped, the way gdb_poll_target() does, and warm
+ * the caches for what GDB reads next.
+ */
+void gdb_stop_reply(target_s *t, target_halt_reason_e reason, target_addr_t watch);
+
+/* '?' in non-stop mode: OK while the target runs, otherwise its stop */
+void gdb_non_stop_status(target_s *t);
+
+#if CONFIG_GDB_INCREMENTAL_FLASH
+/* Flash loads that skip unchanged blocks. Like target_flash_erase() and
+ * target_flash_write() these return `true` on success. `scratch` is used
+ * to read the target's memory map.
+ */
+bool gdb_flash_erase(target_s *t, uint32_t addr, size_t len, char *scratch, size_t scratch_size);
+bool gdb_flash_write(target_s *t, uint32_t addr, const uint8_t *data, size_t len);
+bool gdb_flash_done(target_s *t);
+void gdb_flash_abort(void);
+#endif
+
+#if CONFIG_GDB_CRC_STUB
+/* CRC-32 of target memory as GDB computes it, run on the target core.
+ * Returns `false` if that isn't possible, see gdb_crc.c. A target that
+ * won't halt after the stub is freed, so `cur_target` may be NULL after.
+ */
+bool gdb_crc_stub(target_s *t, uint32_t addr, uint32_t len, uint32_t *crc);
+bool gdb_crc_command(int argc, const char **argv);
+#endif
+
+/* 'vCont;r' range stepping. gdb_range_step() sends the stop reply, and
+ * returns `false` if the target can't be range stepped.
+ */
+bool gdb_range_step_supported(target_s *t);
+bool gdb_range_step(struct bmp_wifi_instance *instance, target_s *t, uint32_t start, uint32_t end);
+
+/* Single-step once and wait for the target to stop again */
+target_halt_reason_e gdb_step_once(target_s *t, target_addr_t *watch);
+
+/* GDB agent expressions. `collect` is called by the trace opcodes, and
+ * evaluation fails if it returns `false`. Without it they do nothing.
+ * `output` receives the text printed by printf, which fails without it.
+ */
+struct gdb_agent_ctx {
+	target_s *t;
+	bool (*collect)(void *arg, uint32_t addr, size_t len);
+	void (*output)(void *arg, const char *text);
+	void *arg;
+};
+
+/* Decode 'X<len>,<hex>' into `code`. Returns what follows it, or NULL. */
+const char *gdb_agent_parse(const char *p, uint8_t *code, size_t max, size_t *len);
+bool gdb_agent_eval(const struct gdb_agent_ctx *ctx, const uint8_t *code, size_t len, uint64_t *result);
+
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+/* Breakpoints with conditions evaluated on the probe. These return `false`
+ * to leave the packet to blackmagic.
+ */
+bool gdb_breakpoint_insert(target_s *t, const char *pbuf);
+bool gdb_breakpoint_remove(target_s *t, const char *pbuf);
+void gdb_breakpoint_clear(void);
+#endif
+
+/* While gdb_breakpoint_active(), gdb_breakpoint_poll() replaces
+ * gdb_poll_target() so that conditional breakpoints and tracepoints are
+ * handled on the probe. It returns `true` while the target is running.
+ */
+bool gdb_breakpoint_active(target_s *t);
+bool gdb_breakpoint_poll(target_s *t);
+
+#if CONFIG_GDB_RTOS_THREADS
+/* FreeRTOS thread awareness. gdb_rtos_packet() handles qSymbol and the
+ * thread packets once the scheduler's symbols are known. The thread list is
+ * cached until gdb_rtos_invalidate().
+ */
+bool gdb_rtos_packet(struct bmp_wifi_instance *instance, target_s *t, char *pbuf, size_t pbuf_size);
+bool gdb_rtos_active(target_s *t);
+uint32_t gdb_rtos_current_thread(target_s *t);
+void gdb_rtos_invalidate(void);
+void gdb_rtos_clear(void);
+#endif
+
+#if CONFIG_GDB_SCAN_CACHE
+/* 'monitor swdp_scan' answered from the last scan while the board behind it
+ * is unchanged. gdb_scan_cache_packet() handles the scan commands.
+ */
+bool gdb_scan_cache_packet(char *pbuf, size_t pbuf_size, size_t size);
+bool gdb_scan_cache_command(int argc, const char **argv);
+void gdb_scan_cache_invalidate(void);
+#endif
+
+#if CONFIG_GDB_TRACEPOINTS
+/* Tracepoints. gdb_trace_packet() handles the trace packets, and reads
+ * while a trace frame is selected. gdb_trace_hit() collects a frame if `pc`
+ * is a tracepoint, and gdb_trace_lift() takes the tracepoint breakpoints at
+ * `pc` out of the target, or puts them back.
+ */
+bool gdb_trace_packet(target_s *t, char *pbuf, size_t pbuf_size);
+bool gdb_trace_active(target_s *t);
+bool gdb_trace_hit(target_s *t, uint32_t pc);
+void gdb_trace_lift(target_s *t, uint32_t pc, bool lifted);
+void gdb_trace_clear(void);
+#endif
+
+extern uint32_t gdb_wifi_rx_bytes;
+extern uint32_t gdb_wifi_rx_calls;
+extern uint32_t gdb_wifi_poll_calls;
+extern uint32_t gdb_wifi_tx_bytes;
+extern uint32_t gdb_wifi_tx_calls;
+extern uint32_t gdb_wifi_rle_saved;
+extern uint32_t gdb_load_bytes;
+extern uint32_t gdb_load_time_ms;
+extern uint32_t gdb_load_bytes_per_sec;
+extern uint32_t gdb_memcache_hits;
+extern uint32_t gdb_memcache_misses;
+extern uint32_t gdb_memcache_uncached;
+extern uint32_t gdb_regcache_hits;
+extern uint32_t gdb_regcache_misses;
+extern uint32_t gdb_prefetch_lines;
+extern uint32_t gdb_prefetch_hits;
+extern uint32_t gdb_flash_blocks_written;
+extern uint32_t gdb_flash_blocks_erased;
+extern uint32_t gdb_flash_blocks_skipped;
+extern uint32_t gdb_crc_stub_runs;
+extern uint32_t gdb_crc_fallbacks;
+extern uint32_t gdb_range_step_requests;
+extern uint32_t gdb_range_step_steps;
+extern uint32_t gdb_range_step_us;
+extern uint32_t gdb_breakpoint_hits;
+extern uint32_t gdb_breakpoint_reports;
+extern uint32_t gdb_breakpoint_printfs;
+extern uint32_t gdb_trace_hits;
+extern uint32_t gdb_trace_frames;
+extern uint32_t gdb_rtos_list_reads;
+extern uint32_t gdb_rtos_replies;
+
 #endif /* GDB_MAIN_FARPATCH_H_ */
@@ -0,0 +1,303 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gdb_main_farpatch.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "target.h"
+
+/* Cache of target memory read by GDB while the target is halted. GDB reads
+ * the same stack frames, globals and vector table again after every step,
+ * and each read costs a series of SWD transactions. Lines are filled on the
+ * first read and dropped as soon as anything may have changed the target:
+ * gdb_fastpath_handle() invalidates the cache before every packet that isn't
+ * a pure read, which covers resume, step, reset, writes and breakpoints.
+ *
+ * Reads that touch a volatile range, such as peripheral registers, always
+ * go to the target.
+ */
+
+#define GDB_MEMCACHE_LINE_SIZE 64U
+#define GDB_MEMCACHE_MAX_VOLATILE 8
+
+/* Prefetch may fill at most half the cache, so it can't evict everything */
+#define GDB_PREFETCH_MAX_BYTES ((CONFIG_GDB_MEMCACHE_LINES / 2U) * GDB_MEMCACHE_LINE_SIZE)
+
+struct gdb_memcache_line {
+	bool valid;
+	bool prefetched;
+	uint32_t addr;
+	uint8_t data[GDB_MEMCACHE_LINE_SIZE];
+};
+
+struct gdb_memcache_range {
+	uint32_t start;
+	uint32_t last;
+};
+
+uint32_t gdb_memcache_hits;
+uint32_t gdb_memcache_misses;
+uint32_t gdb_memcache_uncached;
+uint32_t gdb_prefetch_lines;
+uint32_t gdb_prefetch_hits;
+
+static struct gdb_memcache_line gdb_memcache_lines[CONFIG_GDB_MEMCACHE_LINES];
+static size_t gdb_memcache_victim;
+static target_s *gdb_memcache_target;
+static bool gdb_memcache_enabled = true;
+static bool gdb_prefetch_enabled = CONFIG_GDB_PREFETCH_STACK_BYTES > 0;
+static uint32_t gdb_prefetch_stack_bytes = MIN(CONFIG_GDB_PREFETCH_STACK_BYTES, GDB_PREFETCH_MAX_BYTES);
+
+// Cortex-M peripheral, device and system space
+static struct gdb_memcache_range gdb_memcache_volatile[GDB_MEMCACHE_MAX_VOLATILE] = {
+	{0x40000000, 0x5fffffff},
+	{0xa0000000, 0xffffffff},
+};
+static size_t gdb_memcache_volatile_count = 2;
+
+void gdb_memcache_invalidate(void)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_memcache_lines); i++) {
+		gdb_memcache_lines[i].valid = false;
+	}
+#if CONFIG_GDB_RTOS_THREADS
+	// The thread list is read from the same memory
+	gdb_rtos_invalidate();
+#endif
+}
+
+static bool gdb_memcache_is_volatile(uint32_t start, uint32_t last)
+{
+	for (size_t i = 0; i < gdb_memcache_volatile_count; i++) {
+		if (start <= gdb_memcache_volatile[i].last && last >= gdb_memcache_volatile[i].start) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct gdb_memcache_line *gdb_memcache_find(uint32_t line_addr)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_memcache_lines); i++) {
+		if (gdb_memcache_lines[i].valid && gdb_memcache_lines[i].addr == line_addr) {
+			return &gdb_memcache_lines[i];
+		}
+	}
+	return NULL;
+}
+
+static struct gdb_memcache_line *gdb_memcache_fill(target_s *t, uint32_t line_addr)
+{
+	struct gdb_memcache_line *line = &gdb_memcache_lines[gdb_memcache_victim];
+	gdb_memcache_victim = (gdb_memcache_victim + 1) % ARRAY_LENGTH(gdb_memcache_lines);
+	line->valid = false;
+	line->prefetched = false;
+	if (target_mem_read(t, line->data, line_addr, sizeof(line->data))) {
+		return NULL;
+	}
+	line->addr = line_addr;
+	line->valid = true;
+	return line;
+}
+
+static struct gdb_memcache_line *gdb_memcache_lookup(target_s *t, uint32_t line_addr)
+{
+	struct gdb_memcache_line *line = gdb_memcache_find(line_addr);
+	if (line) {
+		gdb_memcache_hits++;
+		if (line->prefetched) {
+			gdb_prefetch_hits++;
+			line->prefetched = false;
+		}
+		return line;
+	}
+
+	line = gdb_memcache_fill(t, line_addr);
+	if (line) {
+		gdb_memcache_misses++;
+	}
+	return line;
+}
+
+/* Whether reads of [addr, addr + len) may be cached at all. On return
+ * `first_line` and `last_line` bound the lines that cover it.
+ */
+static bool gdb_memcache_cacheable(target_s *t, uint32_t addr, size_t len, uint32_t *first_line, uint32_t *last_line)
+{
+	if (t != gdb_memcache_target) {
+		gdb_memcache_invalidate();
+		gdb_memcache_target = t;
+	}
+
+	*first_line = addr & ~(GDB_MEMCACHE_LINE_SIZE - 1U);
+	*last_line = (addr + len - 1U) | (GDB_MEMCACHE_LINE_SIZE - 1U);
+	return gdb_memcache_enabled && !gdb_target_running && len && *last_line >= *first_line &&
+		!gdb_memcache_is_volatile(*first_line, *last_line);
+}
+
+bool gdb_memcache_read(target_s *t, void *dest, uint32_t addr, size_t len)
+{
+	uint32_t first_line;
+	uint32_t last_line;
+	if (!gdb_memcache_cacheable(t, addr, len, &first_line, &last_line)) {
+		gdb_memcache_uncached++;
+		return target_mem_read(t, dest, addr, len);
+	}
+
+	uint8_t *out = dest;
+	while (len) {
+		uint32_t line_addr = addr & ~(GDB_MEMCACHE_LINE_SIZE - 1U);
+		uint32_t offset = addr - line_addr;
+		size_t chunk = MIN(GDB_MEMCACHE_LINE_SIZE - offset, len);
+
+		struct gdb_memcache_line *line = gdb_memcache_lookup(t, line_addr);
+		if (!line) {
+			// The whole line couldn't be read, perhaps because it runs off the
+			// end of a memory region. Read exactly what was asked for instead.
+			gdb_memcache_uncached++;
+			return target_mem_read(t, out, addr, len);
+		}
+		memcpy(out, line->data + offset, chunk);
+		out += chunk;
+		addr += chunk;
+		len -= chunk;
+	}
+	return false;
+}
+
+/* Fill the lines covering a range before GDB asks for them. Unlike a read,
+ * this never goes to the target for memory that can't be cached.
+ */
+static void gdb_memcache_prefetch(target_s *t, uint32_t addr, size_t len)
+{
+	uint32_t first_line;
+	uint32_t last_line;
+	if (!gdb_memcache_cacheable(t, addr, len, &first_line, &last_line)) {
+		return;
+	}
+
+	for (uint32_t line_addr = first_line; line_addr - first_line < last_line - first_line;
+		 line_addr += GDB_MEMCACHE_LINE_SIZE) {
+		if (gdb_memcache_find(line_addr)) {
+			continue;
+		}
+		struct gdb_memcache_line *line = gdb_memcache_fill(t, line_addr);
+		if (!line) {
+			return;
+		}
+		line->prefetched = true;
+		gdb_prefetch_lines++;
+	}
+}
+
+/* The target just stopped and the stop reply is on its way to GDB, which
+ * will read the registers and then unwind from SP and LR. Fetch all of
+ * that now, so those reads are answered without touching the target.
+ */
+void gdb_memcache_prefetch_halt(target_s *t)
+{
+	if (!gdb_prefetch_enabled || !gdb_memcache_enabled) {
+		return;
+	}
+
+	const char *core = target_core_name(t);
+	const size_t regs_size = target_regs_size(t);
+	size_t sp_offset;
+	size_t lr_offset;
+	if (!core || !regs_size) {
+		return;
+	}
+	if (core[0] == 'M') {
+		// Cortex-M: r0-r12, sp, lr, pc, xpsr
+		sp_offset = 13 * 4;
+		lr_offset = 14 * 4;
+	} else if (!strncmp(core, "rv", 2)) {
+		// RISC-V: x0, ra, sp, ...
+		sp_offset = 2 * 4;
+		lr_offset = 1 * 4;
+	} else {
+		return;
+	}
+	if (regs_size < MAX(sp_offset, lr_offset) + 4) {
+		return;
+	}
+
+	// This also leaves the registers in the register cache for GDB's 'g'
+	uint8_t regs[regs_size];
+	gdb_regcache_regs_read(t, regs, regs_size);
+	uint32_t sp;
+	uint32_t lr;
+	memcpy(&sp, regs + sp_offset, sizeof(sp));
+	memcpy(&lr, regs + lr_offset, sizeof(lr));
+
+	gdb_memcache_prefetch(t, sp, gdb_prefetch_stack_bytes);
+	lr &= ~1U;
+	gdb_memcache_prefetch(t, lr - GDB_MEMCACHE_LINE_SIZE / 2U, GDB_MEMCACHE_LINE_SIZE);
+}
+
+bool gdb_prefetch_command(int argc, const char **argv)
+{
+	if (argc == 1) {
+		gdb_outf("Prefetch is %s, %" PRIu32 " bytes of stack\n", gdb_prefetch_enabled ? "on" : "off",
+			gdb_prefetch_stack_bytes);
+		gdb_outf("Lines prefetched: %" PRIu32 "  used: %" PRIu32 "\n", gdb_prefetch_lines, gdb_prefetch_hits);
+		return true;
+	}
+
+	if (!strcmp(argv[1], "on") || !strcmp(argv[1], "off")) {
+		gdb_prefetch_enabled = !strcmp(argv[1], "on");
+		return true;
+	}
+	uint32_t bytes = strtoul(argv[1], NULL, 0);
+	if (bytes && bytes <= GDB_PREFETCH_MAX_BYTES) {
+		gdb_prefetch_stack_bytes = bytes;
+		gdb_prefetch_enabled = true;
+		return true;
+	}
+
+	gdb_outf("usage: prefetch [on|off|<stack bytes, at most %u>]\n", GDB_PREFETCH_MAX_BYTES);
+	return false;
+}
+
+bool gdb_memcache_command(int argc, const char **argv)
+{
+	if (argc == 1) {
+		gdb_outf("Memory cache is %s, %d lines of %u bytes\n", gdb_memcache_enabled ? "on" : "off",
+			CONFIG_GDB_MEMCACHE_LINES, GDB_MEMCACHE_LINE_SIZE);
+		gdb_outf("Hits: %" PRIu32 "  misses: %" PRIu32 "  uncached: %" PRIu32 "\n", gdb_memcache_hits,
+			gdb_memcache_misses, gdb_memcache_uncached);
+		for (size_t i = 0; i < gdb_memcache_volatile_count; i++) {
+			gdb_outf("Volatile: 0x%08" PRIx32 "-0x%08" PRIx32 "\n", gdb_memcache_volatile[i].start,
+				gdb_memcache_volatile[i].last);
+		}
+		return true;
+	}
+
+	if (!strcmp(argv[1], "on") || !strcmp(argv[1], "off")) {
+		gdb_memcache_enabled = !strcmp(argv[1], "on");
+		gdb_memcache_invalidate();
+		return true;
+	}
+	if (!strcmp(argv[1], "flush")) {
+		gdb_memcache_invalidate();
+		return true;
+	}
+	if (!strcmp(argv[1], "volatile") && argc == 4) {
+		uint32_t start = strtoul(argv[2], NULL, 0);
+		uint32_t len = strtoul(argv[3], NULL, 0);
+		if (!len || gdb_memcache_volatile_count == GDB_MEMCACHE_MAX_VOLATILE) {
+			gdb_out("Unable to add volatile range\n");
+			return false;
+		}
+		gdb_memcache_volatile[gdb_memcache_volatile_count].start = start;
+		gdb_memcache_volatile[gdb_memcache_volatile_count].last = start + len - 1U;
+		gdb_memcache_volatile_count++;
+		gdb_memcache_invalidate();
+		return true;
+	}
+
+	gdb_out("usage: memcache [on|off|flush|volatile <addr> <len>]\n");
+	return false;
+}
@@ -0,0 +1,114 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "gdb_main_farpatch.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "target.h"
+
+/* Range stepping. Without it, GDB's `next` single-steps through the line
+ * one instruction at a time, and every step is a round trip over Wi-Fi plus
+ * a halt poll. With 'vCont;rSTART,END' the probe keeps stepping until the
+ * PC leaves the range and only then sends a stop reply.
+ *
+ * Stepping gives control back after CONFIG_GDB_RANGE_STEP_MAX steps, or as
+ * soon as GDB sends a break. GDB sends the range again if the PC is still
+ * inside it.
+ */
+
+#define TAG "gdb_range_step"
+
+/* How long one step may take before the target is halted */
+#define GDB_RANGE_STEP_TIMEOUT_US 1000000
+
+/* How long to step before blocking for a tick. This task runs just above
+ * IDLE, which has to run before the task watchdog fires.
+ */
+#define GDB_RANGE_STEP_YIELD_US 100000
+
+uint32_t gdb_range_step_requests;
+uint32_t gdb_range_step_steps;
+uint32_t gdb_range_step_us;
+
+bool gdb_range_step_supported(target_s *t)
+{
+	return CONFIG_GDB_RANGE_STEP_MAX > 0 && gdb_regcache_pc_reg(t) >= 0;
+}
+
+static bool gdb_range_step_break(struct bmp_wifi_instance *instance)
+{
+#if CONFIG_GDB_SERVER_MULTIPLEXED
+	gdb_wifi_if_pump_break(instance);
+#endif
+	if (!instance->break_pending) {
+		return false;
+	}
+	instance->break_pending = false;
+	instance->break_at_us = 0;
+	return true;
+}
+
+target_halt_reason_e gdb_step_once(target_s *t, target_addr_t *watch)
+{
+	int64_t deadline = esp_timer_get_time() + GDB_RANGE_STEP_TIMEOUT_US;
+	target_halt_reason_e reason;
+
+	target_halt_resume(t, true);
+	while ((reason = target_halt_poll(t, watch)) == TARGET_HALT_RUNNING) {
+		if (deadline && esp_timer_get_time() > deadline) {
+			ESP_LOGW(TAG, "step timed out");
+			target_halt_request(t);
+			deadline = 0;
+		}
+	}
+	return reason;
+}
+
+bool gdb_range_step(struct bmp_wifi_instance *instance, target_s *t, uint32_t start, uint32_t end)
+{
+	const int pc_reg = gdb_regcache_pc_reg(t);
+	if (CONFIG_GDB_RANGE_STEP_MAX == 0 || pc_reg < 0) {
+		return false;
+	}
+
+	const int64_t started_at = esp_timer_get_time();
+	int64_t yielded_at = started_at;
+	target_halt_reason_e reason;
+	target_addr_t watch = 0;
+	uint32_t steps = 0;
+	bool interrupted = false;
+	for (;;) {
+		reason = gdb_step_once(t, &watch);
+		steps++;
+		if (reason != TARGET_HALT_STEPPING) {
+			break;
+		}
+
+		uint32_t pc = 0;
+		if (target_reg_read(t, pc_reg, &pc, sizeof(pc)) != sizeof(pc) || pc < start || pc >= end ||
+			steps >= CONFIG_GDB_RANGE_STEP_MAX) {
+			break;
+		}
+		if (gdb_range_step_break(instance)) {
+			interrupted = true;
+			break;
+		}
+		if (esp_timer_get_time() - yielded_at > GDB_RANGE_STEP_YIELD_US) {
+			vTaskDelay(1);
+			yielded_at = esp_timer_get_time();
+		}
+	}
+
+	const uint32_t elapsed_us = esp_timer_get_time() - started_at;
+	gdb_range_step_requests++;
+	gdb_range_step_steps += steps;
+	gdb_range_step_us += elapsed_us;
+	ESP_LOGD(TAG, "%" PRIu32 " steps in %" PRIu32 " us", steps, elapsed_us);
+
+	gdb_stop_reply(t, interrupted ? TARGET_HALT_REQUEST : reason, watch);
+	return true;
+}
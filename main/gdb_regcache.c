@@ -0,0 +1,147 @@
+#include <string.h>
+
+#include "gdb_main_farpatch.h"
+#include "general.h"
+#include "target.h"
+
+/* Cache of the target's registers while it is halted. After every stop GDB
+ * reads the general registers with 'g' and often a few more with 'p', and
+ * each one is a series of debug register round trips over SWD. The 'g' set
+ * is captured with a single target_regs_read(), and individual registers
+ * are kept as they are read.
+ *
+ * 'G' writes through to the target and updates the 'g' set. 'P' writes
+ * through and empties the cache, as a write to one register can change
+ * others, such as MSP or CONTROL changing SP. The layout of the 'g' set is up
+ * to the target driver, so a write to it drops the individual registers.
+ * Everything else that isn't a pure read empties the cache, see
+ * gdb_fastpath_handle().
+ */
+
+#define GDB_REGCACHE_MAX_REGS      96
+#define GDB_REGCACHE_MAX_REG_SIZE  8
+#define GDB_REGCACHE_MAX_REGS_SIZE 512
+
+struct gdb_regcache_reg {
+	uint8_t size;
+	uint8_t data[GDB_REGCACHE_MAX_REG_SIZE];
+};
+
+uint32_t gdb_regcache_hits;
+uint32_t gdb_regcache_misses;
+
+static target_s *gdb_regcache_target;
+static size_t gdb_regcache_regs_size;
+static uint8_t gdb_regcache_regs[GDB_REGCACHE_MAX_REGS_SIZE];
+static struct gdb_regcache_reg gdb_regcache_reg[GDB_REGCACHE_MAX_REGS];
+
+static void gdb_regcache_invalidate_regs(void)
+{
+	gdb_regcache_regs_size = 0;
+}
+
+static void gdb_regcache_invalidate_reg(void)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_regcache_reg); i++) {
+		gdb_regcache_reg[i].size = 0;
+	}
+}
+
+void gdb_regcache_invalidate(void)
+{
+	gdb_regcache_invalidate_regs();
+	gdb_regcache_invalidate_reg();
+}
+
+/* Whether the cache may be used for `t` right now */
+static bool gdb_regcache_usable(target_s *t)
+{
+	if (t != gdb_regcache_target) {
+		gdb_regcache_invalidate();
+		gdb_regcache_target = t;
+	}
+	return !gdb_target_running;
+}
+
+int gdb_regcache_pc_reg(target_s *t)
+{
+	const char *core = target_core_name(t);
+	if (!core) {
+		return -1;
+	}
+	if (core[0] == 'M') {
+		// Cortex-M: r0-r12, sp, lr, pc
+		return 15;
+	}
+	if (!strncmp(core, "rv", 2)) {
+		// RISC-V: x0-x31, pc
+		return 32;
+	}
+	return -1;
+}
+
+void gdb_regcache_regs_read(target_s *t, void *data, size_t size)
+{
+	if (!gdb_regcache_usable(t) || size > sizeof(gdb_regcache_regs)) {
+		target_regs_read(t, data);
+		return;
+	}
+
+	if (gdb_regcache_regs_size == size) {
+		gdb_regcache_hits++;
+	} else {
+		gdb_regcache_misses++;
+		target_regs_read(t, gdb_regcache_regs);
+		gdb_regcache_regs_size = size;
+	}
+	memcpy(data, gdb_regcache_regs, size);
+}
+
+void gdb_regcache_regs_write(target_s *t, const void *data, size_t size)
+{
+	target_regs_write(t, data);
+	if (!gdb_regcache_usable(t)) {
+		return;
+	}
+
+	gdb_regcache_invalidate_reg();
+	if (size <= sizeof(gdb_regcache_regs)) {
+		memcpy(gdb_regcache_regs, data, size);
+		gdb_regcache_regs_size = size;
+	} else {
+		gdb_regcache_invalidate_regs();
+	}
+}
+
+size_t gdb_regcache_reg_read(target_s *t, uint32_t reg, void *data, size_t max)
+{
+	if (!gdb_regcache_usable(t) || reg >= GDB_REGCACHE_MAX_REGS) {
+		return target_reg_read(t, reg, data, max);
+	}
+
+	struct gdb_regcache_reg *entry = &gdb_regcache_reg[reg];
+	if (entry->size && entry->size <= max) {
+		gdb_regcache_hits++;
+		memcpy(data, entry->data, entry->size);
+		return entry->size;
+	}
+
+	gdb_regcache_misses++;
+	size_t size = target_reg_read(t, reg, data, max);
+	if (size && size <= sizeof(entry->data)) {
+		memcpy(entry->data, data, size);
+		entry->size = size;
+	}
+	return size;
+}
+
+size_t gdb_regcache_reg_write(target_s *t, uint32_t reg, const void *data, size_t size)
+{
+	size_t written = target_reg_write(t, reg, data, size);
+	if (!gdb_regcache_usable(t)) {
+		return written;
+	}
+
+	gdb_regcache_invalidate();
+	return written;
+}
@@ -0,0 +1,534 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "gdb_if.h"
+#include "gdb_main_farpatch.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "hex_utils.h"
+#include "target.h"
+
+#if CONFIG_GDB_RTOS_THREADS
+
+/* FreeRTOS thread awareness. GDB's thread list would otherwise be built by
+ * GDB itself, one small memory read at a time over the network after every
+ * stop. Instead the probe asks GDB for the scheduler's symbols with qSymbol,
+ * walks the task lists itself and answers qfThreadInfo, qC,
+ * qThreadExtraInfo, 'T' and the registers of other tasks locally. Each list
+ * header is one read, and each task one more. The list is read at most once
+ * per halt, the first time GDB asks about threads, and dropped with the
+ * memory cache. Stop replies only cost a read of pxCurrentTCB.
+ *
+ * Thread IDs are TCB addresses. Registers of tasks that aren't running are
+ * taken from the context the Cortex-M ports save on their stacks (ARM_CM0,
+ * ARM_CM3, ARM_CM4F and ARM_CM7, without the MPU). The FPU ports save one
+ * more word, so the layout follows whether the FPU is enabled in CPACR.
+ * Registers the context doesn't hold are reported as unavailable.
+ */
+
+#define TAG "gdb_rtos"
+
+#define GDB_RTOS_MAX_THREADS    64
+#define GDB_RTOS_MAX_PRIORITIES 32
+#define GDB_RTOS_NAME_LEN       16
+
+/* Layout of the FreeRTOS structures on a 32-bit core */
+#define FREERTOS_LIST_SIZE       20 // uxNumberOfItems, pxIndex, xListEnd
+#define FREERTOS_LIST_END        8  // xListEnd
+#define FREERTOS_LIST_FIRST      12 // xListEnd.pxNext
+#define FREERTOS_ITEM_NEXT       4  // pxNext
+#define FREERTOS_ITEM_OWNER      12 // pvOwner
+#define FREERTOS_TCB_ITEM        4  // xStateListItem
+#define FREERTOS_TCB_PRIORITY    44 // uxPriority
+#define FREERTOS_TCB_NAME        52 // pcTaskName
+#define FREERTOS_TCB_SIZE        (FREERTOS_TCB_NAME + GDB_RTOS_NAME_LEN)
+
+#define CORTEXM_EXC_RETURN_MASK  0xffffff00U
+#define CORTEXM_EXC_RETURN_FTYPE (1U << 4)
+#define CORTEXM_XPSR_STKALIGN    (1U << 9)
+#define CORTEXM_CORE_REGS        17
+#define CORTEXM_CPACR            0xe000ed88U
+#define CORTEXM_CPACR_FPU        (0xfU << 20) // CP10 and CP11
+
+enum gdb_rtos_symbol {
+	GDB_RTOS_SYM_CURRENT_TCB,
+	GDB_RTOS_SYM_READY_LISTS,
+	GDB_RTOS_SYM_DELAYED_1,
+	GDB_RTOS_SYM_DELAYED_2,
+	GDB_RTOS_SYM_PENDING_READY,
+	GDB_RTOS_SYM_SUSPENDED,
+	GDB_RTOS_SYM_TERMINATION,
+	GDB_RTOS_SYM_TOP_USED_PRIORITY,
+	GDB_RTOS_SYM_COUNT,
+};
+
+static const char *const gdb_rtos_symbol_names[GDB_RTOS_SYM_COUNT] = {
+	[GDB_RTOS_SYM_CURRENT_TCB] = "pxCurrentTCB",
+	[GDB_RTOS_SYM_READY_LISTS] = "pxReadyTasksLists",
+	[GDB_RTOS_SYM_DELAYED_1] = "xDelayedTaskList1",
+	[GDB_RTOS_SYM_DELAYED_2] = "xDelayedTaskList2",
+	[GDB_RTOS_SYM_PENDING_READY] = "xPendingReadyList",
+	[GDB_RTOS_SYM_SUSPENDED] = "xSuspendedTaskList",
+	[GDB_RTOS_SYM_TERMINATION] = "xTasksWaitingTermination",
+	[GDB_RTOS_SYM_TOP_USED_PRIORITY] = "uxTopUsedPriority",
+};
+
+enum gdb_rtos_state {
+	GDB_RTOS_RUNNING,
+	GDB_RTOS_READY,
+	GDB_RTOS_BLOCKED,
+	GDB_RTOS_SUSPENDED,
+	GDB_RTOS_DELETED,
+};
+
+static const char *const gdb_rtos_state_names[] = {
+	[GDB_RTOS_RUNNING] = "Running",
+	[GDB_RTOS_READY] = "Ready",
+	[GDB_RTOS_BLOCKED] = "Blocked",
+	[GDB_RTOS_SUSPENDED] = "Suspended",
+	[GDB_RTOS_DELETED] = "Deleted",
+};
+
+struct gdb_rtos_thread {
+	uint32_t tcb;
+	uint32_t top_of_stack;
+	uint32_t priority;
+	uint8_t state;
+	char name[GDB_RTOS_NAME_LEN + 1];
+};
+
+uint32_t gdb_rtos_list_reads;
+uint32_t gdb_rtos_replies;
+
+static target_s *gdb_rtos_target;
+static uint32_t gdb_rtos_symbols[GDB_RTOS_SYM_COUNT];
+static uint32_t gdb_rtos_symbols_found;
+static size_t gdb_rtos_next_symbol;
+
+/* Valid until gdb_rtos_invalidate() */
+static bool gdb_rtos_current_valid;
+static uint32_t gdb_rtos_current;
+static bool gdb_rtos_fpu_valid;
+static bool gdb_rtos_fpu;
+static bool gdb_rtos_valid;
+static size_t gdb_rtos_count;
+static struct gdb_rtos_thread gdb_rtos_threads[GDB_RTOS_MAX_THREADS];
+static size_t gdb_rtos_info_next;
+
+static uint32_t gdb_rtos_word(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static bool gdb_rtos_has(enum gdb_rtos_symbol symbol)
+{
+	return gdb_rtos_symbols_found & (1U << symbol);
+}
+
+void gdb_rtos_invalidate(void)
+{
+	gdb_rtos_current_valid = false;
+	gdb_rtos_fpu_valid = false;
+	gdb_rtos_valid = false;
+}
+
+void gdb_rtos_clear(void)
+{
+	gdb_rtos_target = NULL;
+	gdb_rtos_symbols_found = 0;
+	gdb_rtos_next_symbol = 0;
+	gdb_rtos_invalidate();
+}
+
+bool gdb_rtos_active(target_s *t)
+{
+	const uint32_t required = (1U << GDB_RTOS_SYM_CURRENT_TCB) | (1U << GDB_RTOS_SYM_READY_LISTS) |
+		(1U << GDB_RTOS_SYM_DELAYED_1) | (1U << GDB_RTOS_SYM_DELAYED_2);
+	return t == gdb_rtos_target && (gdb_rtos_symbols_found & required) == required;
+}
+
+/* How many ready lists there are. Without uxTopUsedPriority, the first
+ * delayed list is assumed to follow the ready lists, as tasks.c declares
+ * them.
+ */
+static size_t gdb_rtos_priorities(target_s *t)
+{
+	uint32_t top;
+	if (gdb_rtos_has(GDB_RTOS_SYM_TOP_USED_PRIORITY) &&
+		!target_mem_read(t, &top, gdb_rtos_symbols[GDB_RTOS_SYM_TOP_USED_PRIORITY], sizeof(top))) {
+		return top < GDB_RTOS_MAX_PRIORITIES ? top + 1U : GDB_RTOS_MAX_PRIORITIES;
+	}
+	const uint32_t span = gdb_rtos_symbols[GDB_RTOS_SYM_DELAYED_1] - gdb_rtos_symbols[GDB_RTOS_SYM_READY_LISTS];
+	if (span % FREERTOS_LIST_SIZE || span / FREERTOS_LIST_SIZE > GDB_RTOS_MAX_PRIORITIES) {
+		return 0;
+	}
+	return span / FREERTOS_LIST_SIZE;
+}
+
+/* Add the tasks on the list at `list`, whose header is `hdr` */
+static void gdb_rtos_walk(target_s *t, uint32_t list, const uint8_t *hdr, enum gdb_rtos_state state)
+{
+	const uint32_t items = gdb_rtos_word(hdr);
+	const uint32_t end = list + FREERTOS_LIST_END;
+	uint32_t item = gdb_rtos_word(hdr + FREERTOS_LIST_FIRST);
+
+	for (uint32_t i = 0; i < items && item != end && gdb_rtos_count < ARRAY_LENGTH(gdb_rtos_threads); i++) {
+		// Most lists link tasks through xStateListItem, so read the TCB the
+		// item would be in if it is one. Either way this holds the item.
+		uint8_t tcb[FREERTOS_TCB_SIZE];
+		uint32_t tcb_addr = item - FREERTOS_TCB_ITEM;
+		if (target_mem_read(t, tcb, tcb_addr, sizeof(tcb))) {
+			ESP_LOGW(TAG, "bad task list item at 0x%08" PRIx32, item);
+			return;
+		}
+		const uint32_t next = gdb_rtos_word(tcb + FREERTOS_TCB_ITEM + FREERTOS_ITEM_NEXT);
+		const uint32_t owner = gdb_rtos_word(tcb + FREERTOS_TCB_ITEM + FREERTOS_ITEM_OWNER);
+		// The pending ready list links xEventListItem instead, so the TCB is
+		// wherever the item's owner says
+		if (owner != tcb_addr) {
+			tcb_addr = owner;
+			if (!owner || target_mem_read(t, tcb, tcb_addr, sizeof(tcb)) ||
+				gdb_rtos_word(tcb + FREERTOS_TCB_ITEM + FREERTOS_ITEM_OWNER) != tcb_addr) {
+				ESP_LOGW(TAG, "bad task list item at 0x%08" PRIx32, item);
+				return;
+			}
+		}
+
+		struct gdb_rtos_thread *thread = &gdb_rtos_threads[gdb_rtos_count++];
+		thread->tcb = tcb_addr;
+		thread->top_of_stack = gdb_rtos_word(tcb);
+		thread->priority = gdb_rtos_word(tcb + FREERTOS_TCB_PRIORITY);
+		thread->state = tcb_addr == gdb_rtos_current ? GDB_RTOS_RUNNING : state;
+		for (size_t c = 0; c < GDB_RTOS_NAME_LEN; c++) {
+			const char ch = tcb[FREERTOS_TCB_NAME + c];
+			thread->name[c] = ch >= ' ' && ch <= '~' ? ch : '\0';
+		}
+		thread->name[GDB_RTOS_NAME_LEN] = '\0';
+		item = next;
+	}
+}
+
+/* Read a single list and add its tasks */
+static void gdb_rtos_walk_symbol(target_s *t, enum gdb_rtos_symbol symbol, enum gdb_rtos_state state)
+{
+	uint8_t hdr[FREERTOS_LIST_SIZE];
+	if (!gdb_rtos_has(symbol) || target_mem_read(t, hdr, gdb_rtos_symbols[symbol], sizeof(hdr))) {
+		return;
+	}
+	gdb_rtos_list_reads++;
+	gdb_rtos_walk(t, gdb_rtos_symbols[symbol], hdr, state);
+}
+
+uint32_t gdb_rtos_current_thread(target_s *t)
+{
+	if (!gdb_rtos_active(t) || gdb_target_running) {
+		return 0;
+	}
+	if (!gdb_rtos_current_valid) {
+		gdb_rtos_current_valid = true;
+		if (target_mem_read(t, &gdb_rtos_current, gdb_rtos_symbols[GDB_RTOS_SYM_CURRENT_TCB], 4)) {
+			gdb_rtos_current = 0;
+		}
+	}
+	return gdb_rtos_current;
+}
+
+/* Read the thread list if it isn't cached. Returns `false` if there isn't
+ * one, such as before the scheduler starts.
+ */
+static bool gdb_rtos_update(target_s *t)
+{
+	if (!gdb_rtos_current_thread(t)) {
+		return false;
+	}
+	if (gdb_rtos_valid) {
+		return gdb_rtos_count > 0;
+	}
+	gdb_rtos_valid = true;
+	gdb_rtos_count = 0;
+
+	const size_t priorities = gdb_rtos_priorities(t);
+	if (!priorities) {
+		return false;
+	}
+
+	// All the ready lists in one go
+	uint8_t ready[GDB_RTOS_MAX_PRIORITIES * FREERTOS_LIST_SIZE];
+	if (target_mem_read(t, ready, gdb_rtos_symbols[GDB_RTOS_SYM_READY_LISTS], priorities * FREERTOS_LIST_SIZE)) {
+		return false;
+	}
+	gdb_rtos_list_reads++;
+	for (size_t i = priorities; i > 0; i--) {
+		gdb_rtos_walk(t, gdb_rtos_symbols[GDB_RTOS_SYM_READY_LISTS] + (i - 1U) * FREERTOS_LIST_SIZE,
+			ready + (i - 1U) * FREERTOS_LIST_SIZE, GDB_RTOS_READY);
+	}
+	gdb_rtos_walk_symbol(t, GDB_RTOS_SYM_DELAYED_1, GDB_RTOS_BLOCKED);
+	gdb_rtos_walk_symbol(t, GDB_RTOS_SYM_DELAYED_2, GDB_RTOS_BLOCKED);
+	gdb_rtos_walk_symbol(t, GDB_RTOS_SYM_PENDING_READY, GDB_RTOS_READY);
+	gdb_rtos_walk_symbol(t, GDB_RTOS_SYM_SUSPENDED, GDB_RTOS_SUSPENDED);
+	gdb_rtos_walk_symbol(t, GDB_RTOS_SYM_TERMINATION, GDB_RTOS_DELETED);
+	ESP_LOGD(TAG, "%u threads", (unsigned int)gdb_rtos_count);
+	return gdb_rtos_count > 0;
+}
+
+static const struct gdb_rtos_thread *gdb_rtos_find(uint32_t tcb)
+{
+	for (size_t i = 0; i < gdb_rtos_count; i++) {
+		if (gdb_rtos_threads[i].tcb == tcb) {
+			return &gdb_rtos_threads[i];
+		}
+	}
+	return NULL;
+}
+
+/* Whether the FPU is enabled, and so whether the port is one that saves
+ * EXC_RETURN with each task. Read once per halt.
+ */
+static bool gdb_rtos_fpu_enabled(target_s *t)
+{
+	if (!gdb_rtos_fpu_valid) {
+		uint32_t cpacr;
+		gdb_rtos_fpu_valid = true;
+		gdb_rtos_fpu = !target_mem_read(t, &cpacr, CORTEXM_CPACR, sizeof(cpacr)) && (cpacr & CORTEXM_CPACR_FPU);
+	}
+	return gdb_rtos_fpu;
+}
+
+/* Recover the registers a Cortex-M port saved when it switched away from
+ * `thread`: r4-r11 (and EXC_RETURN on ports with an FPU) by the port, then
+ * the exception frame. Whether the port is one with an FPU is decided by
+ * CPACR rather than by the stack, as on other ports the extra word is the
+ * task's r0.
+ */
+static bool gdb_rtos_stacked_regs(target_s *t, const struct gdb_rtos_thread *thread, uint32_t *regs)
+{
+	const char *core = target_core_name(t);
+	uint32_t sw[9];
+	uint32_t hw[8];
+	if (!core || core[0] != 'M' || target_mem_read(t, sw, thread->top_of_stack, sizeof(sw))) {
+		return false;
+	}
+
+	size_t sw_words = 8;
+	size_t hw_size = sizeof(hw);
+	if (gdb_rtos_fpu_enabled(t)) {
+		if ((sw[8] & CORTEXM_EXC_RETURN_MASK) != CORTEXM_EXC_RETURN_MASK) {
+			return false;
+		}
+		sw_words = 9;
+		if (!(sw[8] & CORTEXM_EXC_RETURN_FTYPE)) {
+			// s16-s31 saved by the port, s0-s15, FPSCR and a reserved word by the core
+			sw_words += 16;
+			hw_size += 18U * 4U;
+		}
+	}
+	const uint32_t frame = thread->top_of_stack + sw_words * 4U;
+	if (target_mem_read(t, hw, frame, sizeof(hw))) {
+		return false;
+	}
+
+	memcpy(regs, hw, 4U * 4U);         // r0-r3
+	memcpy(regs + 4, sw, 8U * 4U);     // r4-r11
+	regs[12] = hw[4];                  // r12
+	regs[13] = frame + hw_size + (hw[7] & CORTEXM_XPSR_STKALIGN ? 4U : 0U);
+	regs[14] = hw[5];                  // lr
+	regs[15] = hw[6];                  // pc
+	regs[16] = hw[7];                  // xpsr
+	return true;
+}
+
+/* 'g' and 'p' for a task that isn't running */
+static void gdb_rtos_read_registers(target_s *t, const struct gdb_rtos_thread *thread, char *pbuf, size_t pbuf_size)
+{
+	uint32_t regs[CORTEXM_CORE_REGS];
+	const size_t regs_size = target_regs_size(t);
+	if (!gdb_rtos_stacked_regs(t, thread, regs)) {
+		gdb_putpacketz("E01");
+		return;
+	}
+
+	if (pbuf[0] == 'p') {
+		const uint32_t reg = strtoul(pbuf + 1, NULL, 16);
+		if (reg < CORTEXM_CORE_REGS) {
+			gdb_if_putpacket(hexify(pbuf, &regs[reg], 4), 8);
+			return;
+		}
+		// The rest aren't saved per task. Their size, such as 8 bytes for an
+		// FPU double, is taken from the running task's register.
+		uint8_t value[8];
+		const size_t size = gdb_regcache_reg_read(t, reg, value, sizeof(value));
+		if (!size) {
+			gdb_putpacketz("EFF");
+			return;
+		}
+		memset(pbuf, 'x', size * 2U);
+		gdb_if_putpacket(pbuf, size * 2U);
+		return;
+	}
+
+	if (regs_size < sizeof(regs) || regs_size * 2U >= pbuf_size) {
+		gdb_putpacketz("E01");
+		return;
+	}
+	hexify(pbuf, regs, sizeof(regs));
+	memset(pbuf + sizeof(regs) * 2U, 'x', (regs_size - sizeof(regs)) * 2U);
+	gdb_if_putpacket(pbuf, regs_size * 2U);
+}
+
+/* 'qSymbol::' starts the lookup and 'qSymbol:value:name' answers a request.
+ * Each reply asks for the next symbol until there are none left.
+ */
+static void gdb_rtos_symbol(target_s *t, const char *p)
+{
+	char reply[64];
+	if (t != gdb_rtos_target || !strcmp(p, ":")) {
+		gdb_rtos_clear();
+		gdb_rtos_target = t;
+	} else {
+		char *end;
+		const uint32_t value = strtoul(p, &end, 16);
+		const bool known = end != p;
+		char name[32] = {0};
+		if (*end == ':' && strlen(end + 1) / 2U < sizeof(name)) {
+			unhexify(name, end + 1, strlen(end + 1) / 2U);
+		}
+		for (size_t i = 0; known && i < GDB_RTOS_SYM_COUNT; i++) {
+			if (!strcmp(name, gdb_rtos_symbol_names[i])) {
+				gdb_rtos_symbols[i] = value;
+				gdb_rtos_symbols_found |= 1U << i;
+			}
+		}
+	}
+	gdb_rtos_valid = false;
+
+	if (gdb_rtos_next_symbol < GDB_RTOS_SYM_COUNT) {
+		const char *name = gdb_rtos_symbol_names[gdb_rtos_next_symbol++];
+		memcpy(reply, "qSymbol:", 8);
+		hexify(reply + 8, name, strlen(name));
+		gdb_putpacketz(reply);
+		return;
+	}
+	if (gdb_rtos_active(t)) {
+		ESP_LOGI(TAG, "FreeRTOS found, pxCurrentTCB at 0x%08" PRIx32, gdb_rtos_symbols[GDB_RTOS_SYM_CURRENT_TCB]);
+	}
+	gdb_putpacketz("OK");
+}
+
+/* 'qfThreadInfo' and 'qsThreadInfo', as many IDs as fit in each reply */
+static void gdb_rtos_thread_info(bool first, char *pbuf, size_t pbuf_size)
+{
+	if (first) {
+		gdb_rtos_info_next = 0;
+	}
+	if (gdb_rtos_info_next >= gdb_rtos_count) {
+		gdb_putpacketz("l");
+		return;
+	}
+	size_t len = 0;
+	pbuf[len++] = 'm';
+	while (gdb_rtos_info_next < gdb_rtos_count && len + 10U < pbuf_size) {
+		len += snprintf(pbuf + len, pbuf_size - len, "%s%" PRIx32, len > 1 ? "," : "",
+			gdb_rtos_threads[gdb_rtos_info_next++].tcb);
+	}
+	gdb_if_putpacket(pbuf, len);
+}
+
+static void gdb_rtos_extra_info(const struct gdb_rtos_thread *thread, char *pbuf)
+{
+	char info[64];
+	const int len = snprintf(info, sizeof(info), "%s, %s, priority %" PRIu32, thread->name,
+		gdb_rtos_state_names[thread->state], thread->priority);
+	gdb_if_putpacket(hexify(pbuf, info, len), len * 2U);
+}
+
+/* Whether the packet is about threads. The list is only read for these. */
+static bool gdb_rtos_is_thread_packet(const struct bmp_wifi_instance *instance, const char *pbuf)
+{
+	switch (pbuf[0]) {
+	case 'q':
+		return !strcmp(pbuf, "qfThreadInfo") || !strcmp(pbuf, "qsThreadInfo") || !strcmp(pbuf, "qC") ||
+			!strncmp(pbuf, "qThreadExtraInfo,", 17);
+	case 'H':
+	case 'T':
+		return true;
+	case 'g':
+	case 'p':
+	case 'G':
+	case 'P':
+		return instance->rtos_thread != 0;
+	default:
+		return false;
+	}
+}
+
+bool gdb_rtos_packet(struct bmp_wifi_instance *instance, target_s *t, char *pbuf, size_t pbuf_size)
+{
+	if (!strncmp(pbuf, "qSymbol:", 8)) {
+		gdb_rtos_symbol(t, pbuf + 8);
+		return true;
+	}
+	// Non-stop mode reports the target as a single thread
+	if (instance->non_stop || !gdb_rtos_is_thread_packet(instance, pbuf) || !gdb_rtos_update(t)) {
+		return false;
+	}
+
+	const struct gdb_rtos_thread *thread;
+	switch (pbuf[0]) {
+	case 'q':
+		if (!strcmp(pbuf, "qfThreadInfo") || !strcmp(pbuf, "qsThreadInfo")) {
+			gdb_rtos_thread_info(pbuf[1] == 'f', pbuf, pbuf_size);
+		} else if (!strcmp(pbuf, "qC")) {
+			gdb_putpacket_f("QC%" PRIx32, gdb_rtos_current);
+		} else if (!strncmp(pbuf, "qThreadExtraInfo,", 17)) {
+			thread = gdb_rtos_find(strtoul(pbuf + 17, NULL, 16));
+			if (!thread) {
+				gdb_putpacketz("E01");
+			} else {
+				gdb_rtos_extra_info(thread, pbuf);
+			}
+		}
+		break;
+
+	case 'H':
+		// 'Hg' picks the thread for register reads; 0 and -1 mean any
+		if (pbuf[1] == 'g') {
+			const uint32_t id = strtoul(pbuf + 2, NULL, 16);
+			instance->rtos_thread = pbuf[2] == '-' || !gdb_rtos_find(id) ? 0 : id;
+		}
+		gdb_putpacketz("OK");
+		break;
+
+	case 'T':
+		gdb_putpacketz(gdb_rtos_find(strtoul(pbuf + 1, NULL, 16)) ? "OK" : "E01");
+		break;
+
+	case 'g':
+	case 'p':
+	case 'G':
+	case 'P':
+		// The running task's registers are the core's
+		thread = gdb_rtos_find(instance->rtos_thread);
+		if (!thread || thread->tcb == gdb_rtos_current) {
+			return false;
+		}
+		if (pbuf[0] == 'G' || pbuf[0] == 'P') {
+			gdb_putpacketz("E01");
+		} else {
+			gdb_rtos_read_registers(t, thread, pbuf, pbuf_size);
+		}
+		break;
+
+	default:
+		return false;
+	}
+	gdb_rtos_replies++;
+	return true;
+}
+
+#endif /* CONFIG_GDB_RTOS_THREADS */
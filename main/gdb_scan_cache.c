@@ -0,0 +1,153 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "adiv5.h"
+#include "cortex.h"
+#include "exception.h"
+#include "gdb_main.h"
+#include "gdb_main_farpatch.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "hex_utils.h"
+#include "target.h"
+
+#if CONFIG_GDB_SCAN_CACHE
+
+/* Cached 'monitor swdp_scan'. A scan walks the DP, every AP and ROM table
+ * and runs every target probe, which takes seconds on a complex SoC. What it
+ * finds is kept by blackmagic in its target list anyway, so after a scan the
+ * list is remembered together with the DP IDCODE and the first entry of the
+ * ROM table behind the first target. A later scan re-reads those two words,
+ * and if the same board is still there the list is shown again as is.
+ *
+ * 'monitor scan_cache clear', or any other scan command, forces a full scan.
+ */
+
+#define TAG "gdb_scan_cache"
+
+struct gdb_scan_cache_key {
+	target_s *first;
+	size_t count;
+	uint32_t dpidr;
+	uint32_t rom_entry;
+};
+
+static struct gdb_scan_cache_key gdb_scan_cache;
+static bool gdb_scan_cache_valid;
+
+uint32_t gdb_scan_cache_hits;
+uint32_t gdb_scan_cache_misses;
+
+static void gdb_scan_cache_first(size_t i, target_s *t, void *context)
+{
+	(void)i;
+	target_s **first = context;
+	if (!*first) {
+		*first = t;
+	}
+}
+
+/* Read the key of the board behind the current target list */
+static bool gdb_scan_cache_read_key(struct gdb_scan_cache_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->count = target_foreach(gdb_scan_cache_first, &key->first);
+	if (!key->first) {
+		return false;
+	}
+
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		adiv5_access_port_s *ap = cortex_ap(key->first);
+		key->dpidr = adiv5_dp_read(ap->dp, ADIV5_DP_DPIDR);
+		adiv5_mem_read(ap, &key->rom_entry, ap->base, sizeof(key->rom_entry));
+	}
+	return e.type == 0;
+}
+
+void gdb_scan_cache_invalidate(void)
+{
+	gdb_scan_cache_valid = false;
+}
+
+static void gdb_scan_cache_display(size_t i, target_s *t, void *context)
+{
+	(void)context;
+	const char *const core_name = target_core_name(t);
+	gdb_outf(" %2u   %c  %s %s\n", (unsigned int)i, target_attached(t) ? '*' : ' ', target_driver_name(t),
+		core_name ? core_name : "");
+}
+
+/* Answer a scan from the cache if the board hasn't changed */
+static bool gdb_scan_cache_lookup(void)
+{
+	struct gdb_scan_cache_key key;
+	if (!gdb_scan_cache_valid || !gdb_scan_cache_read_key(&key) ||
+		memcmp(&key, &gdb_scan_cache, sizeof(key)) != 0) {
+		return false;
+	}
+
+	gdb_out("Target list is unchanged since the last scan\n");
+	gdb_out("Available Targets:\n");
+	gdb_out("No. Att Driver\n");
+	target_foreach(gdb_scan_cache_display, NULL);
+	return true;
+}
+
+bool gdb_scan_cache_packet(char *pbuf, size_t pbuf_size, size_t size)
+{
+	char cmdline[32];
+	const size_t hex_len = strlen(pbuf + 6);
+	if (hex_len / 2U >= sizeof(cmdline)) {
+		return false;
+	}
+	unhexify(cmdline, pbuf + 6, hex_len / 2U);
+	cmdline[hex_len / 2U] = '\0';
+
+	const bool swdp_scan = !strcmp(cmdline, "swdp_scan");
+	if (!swdp_scan && strcmp(cmdline, "jtag_scan") != 0 && strcmp(cmdline, "auto_scan") != 0 &&
+		strncmp(cmdline, "swdp_scan ", 10) != 0 && strncmp(cmdline, "jtag_scan ", 10) != 0) {
+		return false;
+	}
+
+	if (swdp_scan && gdb_scan_cache_lookup()) {
+		gdb_scan_cache_hits++;
+		gdb_putpacketz("OK");
+		return true;
+	}
+
+	gdb_scan_cache_valid = false;
+	gdb_scan_cache_misses++;
+	gdb_target_state_clear();
+	gdb_main(pbuf, pbuf_size, size);
+	if (swdp_scan) {
+		gdb_scan_cache_valid = gdb_scan_cache_read_key(&gdb_scan_cache);
+		ESP_LOGI(TAG, "%s %u targets, DPIDR 0x%08" PRIx32, gdb_scan_cache_valid ? "cached" : "didn't cache",
+			(unsigned int)gdb_scan_cache.count, gdb_scan_cache.dpidr);
+	}
+	return true;
+}
+
+bool gdb_scan_cache_command(int argc, const char **argv)
+{
+	if (argc == 1) {
+		if (gdb_scan_cache_valid) {
+			gdb_outf("Cached %u targets, DPIDR 0x%08" PRIx32 ", ROM table entry 0x%08" PRIx32 "\n",
+				(unsigned int)gdb_scan_cache.count, gdb_scan_cache.dpidr, gdb_scan_cache.rom_entry);
+		} else {
+			gdb_out("Nothing cached\n");
+		}
+		gdb_outf("Hits: %" PRIu32 "  misses: %" PRIu32 "\n", gdb_scan_cache_hits, gdb_scan_cache_misses);
+		return true;
+	}
+	if (!strcmp(argv[1], "clear")) {
+		gdb_scan_cache_invalidate();
+		return true;
+	}
+	return false;
+}
+
+#endif
@@ -0,0 +1,222 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "exception.h"
+#include "gdb_main_farpatch.h"
+
+/* Every GDB session runs in its own task, but they all share `cur_target`
+ * and the one SWD/JTAG engine. Two locks keep them from trampling on each
+ * other:
+ *
+ * - The target lock serialises access to the debug port. It is held for the
+ *   duration of a single packet or a single poll of a running target.
+ * - Ownership decides which session may change target state. The owner may
+ *   do anything; every other session is an observer that may only read
+ *   memory and registers. Sessions that want control queue up behind the
+ *   owner and are handed ownership in order when it lets go.
+ *
+ * If the owner's connection drops and nobody is waiting, the target is
+ * parked rather than freed: the scan, the attached target and its
+ * breakpoints are kept for CONFIG_GDB_RECONNECT_GRACE_MS, and the next
+ * session to claim the target takes them over. Connecting alone doesn't,
+ * so an observer or a port probe leaves a running target alone. Only when
+ * nobody claims it in time is the target freed.
+ */
+
+#define TAG "gdb_lock"
+
+static SemaphoreHandle_t gdb_target_mutex;
+static StaticSemaphore_t gdb_target_mutex_buffer;
+static portMUX_TYPE gdb_owner_spinlock = portMUX_INITIALIZER_UNLOCKED;
+static struct bmp_wifi_instance *gdb_target_owner;
+static struct bmp_wifi_instance *gdb_owner_queue;
+static bool gdb_target_parked;
+static TickType_t gdb_target_parked_at;
+
+uint32_t gdb_target_parks;
+uint32_t gdb_target_unparks;
+
+void gdb_target_lock_init(void)
+{
+	gdb_target_mutex = xSemaphoreCreateMutexStatic(&gdb_target_mutex_buffer);
+	assert(gdb_target_mutex);
+}
+
+bool gdb_target_lock_timeout(struct bmp_wifi_instance *instance, TickType_t ticks)
+{
+	if (instance->holds_target_lock) {
+		return true;
+	}
+	if (xSemaphoreTake(gdb_target_mutex, ticks) != pdTRUE) {
+		return false;
+	}
+	instance->holds_target_lock = true;
+	return true;
+}
+
+void gdb_target_lock(struct bmp_wifi_instance *instance)
+{
+	if (!gdb_target_lock_timeout(instance, pdMS_TO_TICKS(CONFIG_GDB_TARGET_LOCK_TIMEOUT_MS))) {
+		raise_exception(EXCEPTION_MUTEX, "timed out waiting for the target");
+	}
+}
+
+void gdb_target_unlock(struct bmp_wifi_instance *instance)
+{
+	if (!instance->holds_target_lock) {
+		return;
+	}
+	instance->holds_target_lock = false;
+	xSemaphoreGive(gdb_target_mutex);
+}
+
+bool gdb_target_is_owner(const struct bmp_wifi_instance *instance)
+{
+	return gdb_target_owner == instance;
+}
+
+/* Remove `instance` from the wait queue. Must be called with the spinlock held. */
+static void gdb_owner_queue_remove(struct bmp_wifi_instance *instance)
+{
+	struct bmp_wifi_instance **link = &gdb_owner_queue;
+	while (*link) {
+		if (*link == instance) {
+			*link = instance->owner_queue_next;
+			instance->owner_queue_next = NULL;
+			return;
+		}
+		link = &(*link)->owner_queue_next;
+	}
+}
+
+int gdb_target_claim(struct bmp_wifi_instance *instance)
+{
+	int position = 0;
+	bool claimed = false;
+	bool unparked = false;
+
+	taskENTER_CRITICAL(&gdb_owner_spinlock);
+	if (gdb_target_owner == instance) {
+		position = 0;
+	} else if (!gdb_target_owner && (!gdb_owner_queue || gdb_owner_queue == instance)) {
+		gdb_owner_queue_remove(instance);
+		gdb_target_owner = instance;
+		unparked = gdb_target_parked;
+		gdb_target_parked = false;
+		claimed = true;
+	} else {
+		// Join the back of the queue, or report where we already are
+		struct bmp_wifi_instance **link = &gdb_owner_queue;
+		position = 1;
+		while (*link && *link != instance) {
+			link = &(*link)->owner_queue_next;
+			position++;
+		}
+		if (!*link) {
+			*link = instance;
+			instance->owner_queue_next = NULL;
+		}
+	}
+	taskEXIT_CRITICAL(&gdb_owner_spinlock);
+
+	if (claimed) {
+		ESP_LOGI(TAG, "session %d now owns the target", instance->sock);
+	}
+	if (unparked) {
+		gdb_target_unparks++;
+		ESP_LOGI(TAG, "session %d took over the parked target", instance->sock);
+		gdb_target_take_over();
+	}
+	return position;
+}
+
+/* Let go of the target, handing it to the next session in the queue. With
+ * `park` set and nobody waiting, the target is parked instead.
+ */
+static void gdb_target_hand_over(struct bmp_wifi_instance *instance, bool park)
+{
+	struct bmp_wifi_instance *next = NULL;
+	bool parked = false;
+
+	taskENTER_CRITICAL(&gdb_owner_spinlock);
+	gdb_owner_queue_remove(instance);
+	if (gdb_target_owner == instance) {
+		next = gdb_owner_queue;
+		if (next) {
+			gdb_owner_queue_remove(next);
+		} else if (park) {
+			gdb_target_parked = true;
+			gdb_target_parked_at = xTaskGetTickCount();
+			parked = true;
+		}
+		gdb_target_owner = next;
+	}
+	taskEXIT_CRITICAL(&gdb_owner_spinlock);
+
+	if (next) {
+		ESP_LOGI(TAG, "session %d handed the target to session %d", instance->sock, next->sock);
+	} else if (parked) {
+		gdb_target_parks++;
+		ESP_LOGI(TAG, "session %d went away -- keeping the target for %d ms", instance->sock,
+			CONFIG_GDB_RECONNECT_GRACE_MS);
+	}
+}
+
+void gdb_target_release(struct bmp_wifi_instance *instance)
+{
+	gdb_target_hand_over(instance, false);
+}
+
+void gdb_target_park(struct bmp_wifi_instance *instance)
+{
+	gdb_target_hand_over(instance, true);
+}
+
+TickType_t gdb_target_parked_ticks(void)
+{
+	TickType_t ticks = portMAX_DELAY;
+
+	taskENTER_CRITICAL(&gdb_owner_spinlock);
+	if (gdb_target_parked) {
+		const TickType_t elapsed = xTaskGetTickCount() - gdb_target_parked_at;
+		const TickType_t grace = pdMS_TO_TICKS(CONFIG_GDB_RECONNECT_GRACE_MS);
+		ticks = elapsed < grace ? grace - elapsed : 0;
+	}
+	taskEXIT_CRITICAL(&gdb_owner_spinlock);
+	return ticks;
+}
+
+void gdb_target_park_expire(void)
+{
+	if (gdb_target_parked_ticks() != 0) {
+		return;
+	}
+
+	bool expired = false;
+	taskENTER_CRITICAL(&gdb_owner_spinlock);
+	if (gdb_target_parked && !gdb_target_owner) {
+		gdb_target_parked = false;
+		expired = true;
+	}
+	taskEXIT_CRITICAL(&gdb_owner_spinlock);
+	if (!expired) {
+		return;
+	}
+
+	ESP_LOGI(TAG, "nobody reconnected -- freeing the target");
+	xSemaphoreTake(gdb_target_mutex, portMAX_DELAY);
+	gdb_target_free();
+	xSemaphoreGive(gdb_target_mutex);
+}
+
+bool gdb_target_has_owner(void)
+{
+	return gdb_target_owner != NULL;
+}
@@ -0,0 +1,659 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "gdb_if.h"
+#include "gdb_main_farpatch.h"
+#include "gdb_packet.h"
+#include "general.h"
+#include "hex_utils.h"
+#include "target.h"
+
+#if CONFIG_GDB_TRACEPOINTS
+
+/* Tracepoints. GDB downloads the tracepoints with QTDP and starts tracing
+ * with QTStart. Each hit is then handled on the probe: the registers and
+ * memory the actions ask for are copied into the trace buffer and the
+ * target is resumed, all without a round trip to GDB. Afterwards `tfind`
+ * selects a frame with QTFrame, and while one is selected 'g', 'm' and 'x'
+ * are answered from it.
+ *
+ * Supported actions are 'R' (all registers), 'M' (a memory range, absolute
+ * or relative to a register) and 'X' (an agent expression, collecting what
+ * its trace opcodes name). while-stepping, trace state variables and fast
+ * tracepoints are not.
+ */
+
+#define TAG "gdb_trace"
+
+#define GDB_TRACE_MAX_TRACEPOINTS   8
+#define GDB_TRACE_COND_SIZE         64
+#define GDB_TRACE_ACTIONS_SIZE      384
+#define GDB_TRACE_MAX_REGS_SIZE     512
+#define GDB_TRACE_CORTEXM_CORE_REGS 17
+
+struct gdb_tracepoint {
+	bool used;
+	bool enabled;
+	bool installed;
+	/* Breakpoint kind it was installed with */
+	uint8_t kind;
+	uint32_t number;
+	uint32_t addr;
+	uint32_t pass;
+	uint32_t hits;
+	size_t cond_len;
+	uint8_t cond[GDB_TRACE_COND_SIZE];
+	/* Action strings as sent by GDB, each terminated by a NUL */
+	size_t actions_len;
+	char actions[GDB_TRACE_ACTIONS_SIZE];
+};
+
+/* Frames in the trace buffer: a header, then 'R' and 'M' blocks */
+struct gdb_trace_frame_hdr {
+	uint32_t number;
+	uint32_t len;
+};
+
+enum gdb_trace_stop {
+	GDB_TRACE_NOT_RUN,
+	GDB_TRACE_RUNNING,
+	GDB_TRACE_STOPPED,
+	GDB_TRACE_FULL,
+	GDB_TRACE_PASSCOUNT,
+};
+
+uint32_t gdb_trace_hits;
+uint32_t gdb_trace_frames;
+
+static target_s *gdb_trace_target;
+static struct gdb_tracepoint gdb_tracepoints[GDB_TRACE_MAX_TRACEPOINTS];
+static enum gdb_trace_stop gdb_trace_state;
+static uint32_t gdb_trace_stop_tracepoint;
+
+static uint8_t *gdb_trace_buf;
+static size_t gdb_trace_used;
+static int gdb_trace_selected = -1;
+
+/* The frame being collected */
+static size_t gdb_trace_pos;
+static bool gdb_trace_overflow;
+
+static struct gdb_tracepoint *gdb_trace_find(uint32_t number, uint32_t addr)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_tracepoints); i++) {
+		struct gdb_tracepoint *tp = &gdb_tracepoints[i];
+		if (tp->used && tp->number == number && tp->addr == addr) {
+			return tp;
+		}
+	}
+	return NULL;
+}
+
+/* The breakpoint kind GDB would use: 2 for Thumb, which is all Cortex-M
+ * runs, and 4 otherwise
+ */
+static uint8_t gdb_trace_kind(target_s *t)
+{
+	const char *core = target_core_name(t);
+	return core && core[0] == 'M' ? 2 : 4;
+}
+
+static void gdb_trace_uninstall(target_s *t)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_tracepoints); i++) {
+		struct gdb_tracepoint *tp = &gdb_tracepoints[i];
+		if (tp->installed) {
+			target_breakwatch_clear(t, TARGET_BREAK_HARD, tp->addr, tp->kind);
+			tp->installed = false;
+		}
+	}
+}
+
+static void gdb_trace_stop(target_s *t, enum gdb_trace_stop reason)
+{
+	if (gdb_trace_state == GDB_TRACE_RUNNING) {
+		gdb_trace_uninstall(t);
+		gdb_trace_state = reason;
+	}
+}
+
+void gdb_trace_clear(void)
+{
+	memset(gdb_tracepoints, 0, sizeof(gdb_tracepoints));
+	gdb_trace_state = GDB_TRACE_NOT_RUN;
+	gdb_trace_target = NULL;
+	gdb_trace_used = 0;
+	gdb_trace_frames = 0;
+	gdb_trace_selected = -1;
+	heap_caps_free(gdb_trace_buf);
+	gdb_trace_buf = NULL;
+}
+
+bool gdb_trace_active(target_s *t)
+{
+	return gdb_trace_state == GDB_TRACE_RUNNING && t == gdb_trace_target;
+}
+
+/* 'QTDP:n:addr:E|D:step:pass[:Xlen,cond][-]' defines a tracepoint, and
+ * 'QTDP:-n:addr:action[-]' adds an action to it.
+ */
+static bool gdb_trace_define(const char *p)
+{
+	char *end;
+	const bool action = *p == '-';
+	const uint32_t number = strtoul(p + action, &end, 16);
+	if (*end != ':') {
+		return false;
+	}
+	const uint32_t addr = strtoul(end + 1, &end, 16);
+	if (*end != ':') {
+		return false;
+	}
+	p = end + 1;
+
+	struct gdb_tracepoint *tp = gdb_trace_find(number, addr);
+	if (action) {
+		size_t len = strlen(p);
+		if (len && p[len - 1U] == '-') {
+			len--;
+		}
+		if (!tp || tp->actions_len + len + 1U > sizeof(tp->actions)) {
+			return false;
+		}
+		// while-stepping actions are accepted and ignored
+		if (p[0] != 'S') {
+			memcpy(tp->actions + tp->actions_len, p, len);
+			tp->actions[tp->actions_len + len] = '\0';
+			tp->actions_len += len + 1U;
+		}
+		return true;
+	}
+
+	for (size_t i = 0; !tp && i < ARRAY_LENGTH(gdb_tracepoints); i++) {
+		if (!gdb_tracepoints[i].used) {
+			tp = &gdb_tracepoints[i];
+		}
+	}
+	if (!tp) {
+		return false;
+	}
+	memset(tp, 0, sizeof(*tp));
+	tp->number = number;
+	tp->addr = addr;
+	tp->enabled = *p == 'E';
+	strtoul(p + 2, &end, 16); // step count
+	if (*end != ':') {
+		return false;
+	}
+	tp->pass = strtoul(end + 1, &end, 16);
+	while (*end == ':') {
+		if (end[1] == 'X') {
+			end = (char *)gdb_agent_parse(end + 1, tp->cond, sizeof(tp->cond), &tp->cond_len);
+			if (!end) {
+				return false;
+			}
+		} else {
+			// Fast tracepoint length and anything newer
+			end = strchr(end + 1, ':') ?: strchr(end + 1, '\0');
+		}
+	}
+	tp->used = true;
+	return true;
+}
+
+static bool gdb_trace_start(target_s *t)
+{
+	if (!gdb_trace_buf) {
+		gdb_trace_buf = heap_caps_malloc(CONFIG_GDB_TRACE_BUFFER_SIZE, MALLOC_CAP_SPIRAM);
+		if (!gdb_trace_buf) {
+			gdb_trace_buf = heap_caps_malloc(CONFIG_GDB_TRACE_BUFFER_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+		}
+		if (!gdb_trace_buf) {
+			ESP_LOGE(TAG, "no memory for a %u byte trace buffer", CONFIG_GDB_TRACE_BUFFER_SIZE);
+			return false;
+		}
+	}
+	gdb_trace_used = 0;
+	gdb_trace_frames = 0;
+	gdb_trace_selected = -1;
+	gdb_trace_target = t;
+
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_tracepoints); i++) {
+		struct gdb_tracepoint *tp = &gdb_tracepoints[i];
+		tp->hits = 0;
+		if (!tp->used || !tp->enabled) {
+			continue;
+		}
+		tp->kind = gdb_trace_kind(t);
+		if (target_breakwatch_set(t, TARGET_BREAK_HARD, tp->addr, tp->kind) != 0) {
+			ESP_LOGE(TAG, "unable to set tracepoint %" PRIu32 " at 0x%08" PRIx32, tp->number, tp->addr);
+			gdb_trace_uninstall(t);
+			return false;
+		}
+		tp->installed = true;
+	}
+	gdb_trace_state = GDB_TRACE_RUNNING;
+	return true;
+}
+
+/* Append a block to the frame being collected */
+static uint8_t *gdb_trace_reserve(size_t len)
+{
+	if (gdb_trace_overflow || gdb_trace_pos + len > CONFIG_GDB_TRACE_BUFFER_SIZE) {
+		gdb_trace_overflow = true;
+		return NULL;
+	}
+	uint8_t *block = gdb_trace_buf + gdb_trace_pos;
+	gdb_trace_pos += len;
+	return block;
+}
+
+static bool gdb_trace_collect_memory(void *arg, uint32_t addr, size_t len)
+{
+	target_s *t = arg;
+	if (len > UINT16_MAX) {
+		return false;
+	}
+	uint8_t *block = gdb_trace_reserve(1U + 4U + 2U + len);
+	if (!block) {
+		return true;
+	}
+	const uint16_t len16 = len;
+	block[0] = 'M';
+	memcpy(block + 1, &addr, 4);
+	memcpy(block + 5, &len16, 2);
+	if (gdb_memcache_read(t, block + 7, addr, len)) {
+		// Keep the frame, but without this block
+		gdb_trace_pos -= 1U + 4U + 2U + len;
+	}
+	return true;
+}
+
+static void gdb_trace_collect_registers(target_s *t)
+{
+	const size_t regs_size = target_regs_size(t);
+	if (!regs_size || regs_size > GDB_TRACE_MAX_REGS_SIZE) {
+		return;
+	}
+	uint8_t *block = gdb_trace_reserve(1U + 2U + regs_size);
+	if (!block) {
+		return;
+	}
+	const uint16_t len16 = regs_size;
+	block[0] = 'R';
+	memcpy(block + 1, &len16, 2);
+	gdb_regcache_regs_read(t, block + 3, regs_size);
+}
+
+static void gdb_trace_collect_action(target_s *t, const char *action)
+{
+	switch (action[0]) {
+	case 'R':
+		gdb_trace_collect_registers(t);
+		break;
+
+	case 'M': {
+		// 'M<basereg>,<offset>,<len>', where basereg -1 means absolute
+		char *end;
+		int basereg = -1;
+		const char *p = action + 1;
+		if (*p == '-') {
+			p = strchr(p, ',');
+		} else {
+			basereg = strtoul(p, &end, 16);
+			p = end;
+		}
+		if (!p || *p != ',') {
+			break;
+		}
+		uint32_t addr = strtoul(p + 1, &end, 16);
+		if (*end != ',') {
+			break;
+		}
+		const uint32_t len = strtoul(end + 1, NULL, 16);
+		if (basereg >= 0) {
+			uint32_t base = 0;
+			gdb_regcache_reg_read(t, basereg, &base, sizeof(base));
+			addr += base;
+		}
+		gdb_trace_collect_memory(t, addr, len);
+		break;
+	}
+
+	case 'X': {
+		uint8_t code[GDB_TRACE_ACTIONS_SIZE / 2];
+		size_t len;
+		uint64_t result;
+		const struct gdb_agent_ctx ctx = {
+			.t = t,
+			.collect = gdb_trace_collect_memory,
+			.arg = t,
+		};
+		if (gdb_agent_parse(action, code, sizeof(code), &len)) {
+			gdb_agent_eval(&ctx, code, len, &result);
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+static void gdb_trace_collect(target_s *t, struct gdb_tracepoint *tp)
+{
+	const size_t start = gdb_trace_used;
+	gdb_trace_pos = start;
+	gdb_trace_overflow = false;
+
+	uint8_t *hdr = gdb_trace_reserve(sizeof(struct gdb_trace_frame_hdr));
+	for (size_t offset = 0; hdr && offset < tp->actions_len; offset += strlen(tp->actions + offset) + 1U) {
+		gdb_trace_collect_action(t, tp->actions + offset);
+	}
+	if (gdb_trace_overflow) {
+		gdb_trace_stop(t, GDB_TRACE_FULL);
+		return;
+	}
+
+	const struct gdb_trace_frame_hdr frame = {
+		.number = tp->number,
+		.len = gdb_trace_pos - start,
+	};
+	memcpy(hdr, &frame, sizeof(frame));
+	gdb_trace_used = gdb_trace_pos;
+	gdb_trace_frames++;
+}
+
+bool gdb_trace_hit(target_s *t, uint32_t pc)
+{
+	bool hit = false;
+	if (!gdb_trace_active(t)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_tracepoints) && gdb_trace_active(t); i++) {
+		struct gdb_tracepoint *tp = &gdb_tracepoints[i];
+		if (!tp->installed || tp->addr != pc) {
+			continue;
+		}
+		hit = true;
+		tp->hits++;
+		gdb_trace_hits++;
+
+		uint64_t result;
+		const struct gdb_agent_ctx ctx = {.t = t};
+		if (tp->cond_len && (!gdb_agent_eval(&ctx, tp->cond, tp->cond_len, &result) || !result)) {
+			continue;
+		}
+		gdb_trace_collect(t, tp);
+		if (tp->pass && tp->hits >= tp->pass) {
+			gdb_trace_stop_tracepoint = tp->number;
+			gdb_trace_stop(t, GDB_TRACE_PASSCOUNT);
+		}
+	}
+	return hit;
+}
+
+void gdb_trace_lift(target_s *t, uint32_t pc, bool lifted)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_tracepoints); i++) {
+		const struct gdb_tracepoint *tp = &gdb_tracepoints[i];
+		if (!tp->installed || tp->addr != pc) {
+			continue;
+		}
+		if (lifted) {
+			target_breakwatch_clear(t, TARGET_BREAK_HARD, tp->addr, tp->kind);
+		} else {
+			target_breakwatch_set(t, TARGET_BREAK_HARD, tp->addr, tp->kind);
+		}
+	}
+}
+
+/* Find frame `n`. Frames aren't aligned in the buffer, so the header is
+ * copied out.
+ */
+static bool gdb_trace_frame(int n, size_t *offset, struct gdb_trace_frame_hdr *hdr)
+{
+	*offset = 0;
+	for (int i = 0; gdb_trace_buf && *offset < gdb_trace_used; i++) {
+		memcpy(hdr, gdb_trace_buf + *offset, sizeof(*hdr));
+		if (i == n) {
+			return true;
+		}
+		*offset += hdr->len;
+	}
+	return false;
+}
+
+/* Find a block of `type` in the selected frame, or a memory block covering
+ * [addr, addr + len). Returns its data.
+ */
+static const uint8_t *gdb_trace_block(char type, uint32_t addr, size_t len, size_t *block_len)
+{
+	struct gdb_trace_frame_hdr frame;
+	size_t offset;
+	if (!gdb_trace_frame(gdb_trace_selected, &offset, &frame)) {
+		return NULL;
+	}
+	const uint8_t *p = gdb_trace_buf + offset + sizeof(frame);
+	const uint8_t *end = gdb_trace_buf + offset + frame.len;
+	while (p < end) {
+		uint16_t size;
+		if (*p == 'R') {
+			memcpy(&size, p + 1, 2);
+			if (type == 'R') {
+				*block_len = size;
+				return p + 3;
+			}
+			p += 3U + size;
+		} else {
+			uint32_t start;
+			memcpy(&start, p + 1, 4);
+			memcpy(&size, p + 5, 2);
+			if (type == 'M' && addr >= start && addr - start + len <= size) {
+				*block_len = len;
+				return p + 7 + (addr - start);
+			}
+			p += 7U + size;
+		}
+	}
+	return NULL;
+}
+
+static bool gdb_trace_frame_matches(const struct gdb_trace_frame_hdr *frame, const char *how, uint32_t a, uint32_t b)
+{
+	const struct gdb_tracepoint *tp = NULL;
+	for (size_t i = 0; i < ARRAY_LENGTH(gdb_tracepoints); i++) {
+		if (gdb_tracepoints[i].used && gdb_tracepoints[i].number == frame->number) {
+			tp = &gdb_tracepoints[i];
+		}
+	}
+	const uint32_t pc = tp ? tp->addr : 0;
+
+	if (!strcmp(how, "tdp")) {
+		return frame->number == a;
+	}
+	if (!strcmp(how, "pc")) {
+		return tp && pc == a;
+	}
+	if (!strcmp(how, "range")) {
+		return tp && pc >= a && pc <= b;
+	}
+	if (!strcmp(how, "outside")) {
+		return tp && (pc < a || pc > b);
+	}
+	return false;
+}
+
+/* 'QTFrame:n', or 'QTFrame:<how>:<args>' to search onwards from the selected frame */
+static void gdb_trace_select(const char *p)
+{
+	struct gdb_trace_frame_hdr frame;
+	size_t offset;
+	char reply[24];
+	int n = -1;
+
+	if (!strncmp(p, "pc:", 3) || !strncmp(p, "tdp:", 4) || !strncmp(p, "range:", 6) || !strncmp(p, "outside:", 8)) {
+		char how[8];
+		size_t how_len = strchr(p, ':') - p;
+		memcpy(how, p, how_len);
+		how[how_len] = '\0';
+		char *end;
+		const uint32_t a = strtoul(p + how_len + 1U, &end, 16);
+		const uint32_t b = *end == ':' ? strtoul(end + 1, NULL, 16) : 0;
+		/* Walk on from the selected frame rather than from frame 0 for each candidate */
+		offset = 0;
+		if (gdb_trace_selected >= 0 && gdb_trace_frame(gdb_trace_selected, &offset, &frame)) {
+			offset += frame.len;
+		}
+		for (int i = gdb_trace_selected + 1; gdb_trace_buf && offset < gdb_trace_used; i++) {
+			memcpy(&frame, gdb_trace_buf + offset, sizeof(frame));
+			if (gdb_trace_frame_matches(&frame, how, a, b)) {
+				n = i;
+				break;
+			}
+			offset += frame.len;
+		}
+	} else {
+		n = (int)strtoul(p, NULL, 16);
+		if (n >= 0 && !gdb_trace_frame(n, &offset, &frame)) {
+			n = -1;
+		}
+	}
+
+	if (n < 0) {
+		gdb_trace_selected = -1;
+		gdb_putpacketz("F-1");
+		return;
+	}
+	gdb_trace_selected = n;
+	snprintf(reply, sizeof(reply), "F%XT%" PRIX32, n, frame.number);
+	gdb_putpacketz(reply);
+}
+
+static void gdb_trace_status(void)
+{
+	static const char *const reasons[] = {
+		[GDB_TRACE_NOT_RUN] = "tnotrun:0",
+		[GDB_TRACE_RUNNING] = "tnotrun:0",
+		[GDB_TRACE_STOPPED] = "tstop:0",
+		[GDB_TRACE_FULL] = "tfull:0",
+		[GDB_TRACE_PASSCOUNT] = "tpasscount:",
+	};
+	char reply[128];
+
+	int len = snprintf(reply, sizeof(reply), "T%d;%s", gdb_trace_state == GDB_TRACE_RUNNING,
+		reasons[gdb_trace_state]);
+	if (gdb_trace_state == GDB_TRACE_PASSCOUNT) {
+		len += snprintf(reply + len, sizeof(reply) - len, "%" PRIX32, gdb_trace_stop_tracepoint);
+	}
+	snprintf(reply + len, sizeof(reply) - len, ";tframes:%" PRIX32 ";tcreated:%" PRIX32 ";tfree:%X;tsize:%X;circular:0",
+		gdb_trace_frames, gdb_trace_frames, (unsigned int)(CONFIG_GDB_TRACE_BUFFER_SIZE - gdb_trace_used),
+		CONFIG_GDB_TRACE_BUFFER_SIZE);
+	gdb_putpacketz(reply);
+}
+
+/* 'g', 'p', 'm' and 'x' while a trace frame is selected */
+static bool gdb_trace_frame_packet(target_s *t, char *pbuf, size_t pbuf_size)
+{
+	const uint8_t *data;
+	size_t len;
+	uint32_t addr;
+	uint32_t count;
+
+	switch (pbuf[0]) {
+	case 'g':
+		data = gdb_trace_block('R', 0, 0, &len);
+		if (!data || len * 2U >= pbuf_size) {
+			gdb_putpacketz("E01");
+			return true;
+		}
+		gdb_if_putpacket(hexify(pbuf, data, len), len * 2U);
+		return true;
+
+	case 'p': {
+		// Only the Cortex-M core registers, 4 bytes each at the start of the
+		// 'g' set, have a known place in the 'R' block
+		const char *core = t ? target_core_name(t) : NULL;
+		const uint32_t reg = strtoul(pbuf + 1, NULL, 16);
+		data = gdb_trace_block('R', 0, 0, &len);
+		if (!data || !core || core[0] != 'M' || reg >= GDB_TRACE_CORTEXM_CORE_REGS || (reg + 1U) * 4U > len) {
+			gdb_putpacketz("E01");
+			return true;
+		}
+		gdb_if_putpacket(hexify(pbuf, data + reg * 4U, 4), 8);
+		return true;
+	}
+
+	case 'm':
+	case 'x':
+		if (sscanf(pbuf + 1, "%" SCNx32 ",%" SCNx32, &addr, &count) != 2 || count * 2U >= pbuf_size) {
+			gdb_putpacketz("E01");
+			return true;
+		}
+		data = gdb_trace_block('M', addr, count, &len);
+		if (!data) {
+			gdb_putpacketz("E01");
+		} else if (pbuf[0] == 'x') {
+			gdb_if_putpacket_binary("b", 1, (const char *)data, len);
+		} else {
+			gdb_if_putpacket(hexify(pbuf, data, len), len * 2U);
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+bool gdb_trace_packet(target_s *t, char *pbuf, size_t pbuf_size)
+{
+	if (gdb_trace_selected >= 0 && gdb_trace_frame_packet(t, pbuf, pbuf_size)) {
+		return true;
+	}
+
+	if (!strcmp(pbuf, "qTStatus")) {
+		gdb_trace_status();
+	} else if (!strcmp(pbuf, "QTinit")) {
+		gdb_trace_stop(t, GDB_TRACE_STOPPED);
+		memset(gdb_tracepoints, 0, sizeof(gdb_tracepoints));
+		gdb_trace_state = GDB_TRACE_NOT_RUN;
+		gdb_trace_used = 0;
+		gdb_trace_frames = 0;
+		gdb_trace_selected = -1;
+		gdb_putpacketz("OK");
+	} else if (!strncmp(pbuf, "QTDP:", 5)) {
+		gdb_putpacketz(gdb_trace_define(pbuf + 5) ? "OK" : "E01");
+	} else if (!strcmp(pbuf, "QTStart")) {
+		gdb_putpacketz(t && gdb_trace_start(t) ? "OK" : "E01");
+	} else if (!strcmp(pbuf, "QTStop")) {
+		gdb_trace_stop(t, GDB_TRACE_STOPPED);
+		gdb_putpacketz("OK");
+	} else if (!strncmp(pbuf, "QTFrame:", 8)) {
+		gdb_trace_select(pbuf + 8);
+	} else if (!strncmp(pbuf, "qTP:", 4)) {
+		char *end;
+		const uint32_t number = strtoul(pbuf + 4, &end, 16);
+		const struct gdb_tracepoint *tp = *end == ':' ? gdb_trace_find(number, strtoul(end + 1, NULL, 16)) : NULL;
+		char reply[24];
+		snprintf(reply, sizeof(reply), "V%" PRIX32 ":0", tp ? tp->hits : 0);
+		gdb_putpacketz(reply);
+	} else if (!strcmp(pbuf, "qTfP") || !strcmp(pbuf, "qTsP") || !strcmp(pbuf, "qTfV") || !strcmp(pbuf, "qTsV")) {
+		// Nothing to upload
+		gdb_putpacketz("l");
+	} else if (!strncmp(pbuf, "QTDPsrc:", 8) || !strncmp(pbuf, "QTDV:", 5) || !strncmp(pbuf, "QTro", 4) ||
+		!strncmp(pbuf, "QTDisconnected:", 15) || !strncmp(pbuf, "QTBuffer:", 9) || !strncmp(pbuf, "QTNotes:", 8)) {
+		// Accepted, and ignored
+		gdb_putpacketz("OK");
+	} else {
+		return false;
+	}
+	return true;
+}
+
+#endif /* CONFIG_GDB_TRACEPOINTS */
@@ -80,6 +80,52 @@ extern uint32_t uart_tx_count;
 extern uint32_t uart_irq_count;
 extern uint32_t uart_rx_data_relay;
 
+extern uint32_t gdb_wifi_rx_bytes;
+extern uint32_t gdb_wifi_rx_calls;
+extern uint32_t gdb_wifi_poll_calls;
+extern uint32_t gdb_wifi_tx_bytes;
+extern uint32_t gdb_wifi_tx_calls;
+extern uint32_t gdb_wifi_rle_saved;
+extern uint32_t gdb_poll_count;
+extern uint32_t gdb_poll_interval_ms;
+extern uint32_t gdb_halt_latency_us;
+extern uint32_t gdb_halt_latency_max_us;
+extern uint32_t gdb_session_pool_used;
+extern uint32_t gdb_session_pool_peak;
+extern uint32_t gdb_session_pool_rejected;
+extern uint32_t gdb_packet_size;
+extern uint32_t gdb_load_bytes;
+extern uint32_t gdb_load_time_ms;
+extern uint32_t gdb_load_bytes_per_sec;
+extern uint32_t gdb_memcache_hits;
+extern uint32_t gdb_memcache_misses;
+extern uint32_t gdb_memcache_uncached;
+extern uint32_t gdb_regcache_hits;
+extern uint32_t gdb_regcache_misses;
+extern uint32_t gdb_prefetch_lines;
+extern uint32_t gdb_prefetch_hits;
+extern uint32_t gdb_flash_blocks_written;
+extern uint32_t gdb_flash_blocks_erased;
+extern uint32_t gdb_flash_blocks_skipped;
+extern uint32_t gdb_crc_stub_runs;
+extern uint32_t gdb_crc_fallbacks;
+extern uint32_t gdb_range_step_requests;
+extern uint32_t gdb_range_step_steps;
+extern uint32_t gdb_range_step_us;
+extern uint32_t gdb_breakpoint_hits;
+extern uint32_t gdb_breakpoint_reports;
+extern uint32_t gdb_breakpoint_printfs;
+extern uint32_t gdb_trace_hits;
+extern uint32_t gdb_trace_frames;
+extern uint32_t gdb_rtos_list_reads;
+extern uint32_t gdb_rtos_replies;
+extern uint32_t gdb_non_stop_resumes;
+extern uint32_t gdb_non_stop_notifications;
+extern uint32_t gdb_target_parks;
+extern uint32_t gdb_target_unparks;
+extern uint32_t gdb_scan_cache_hits;
+extern uint32_t gdb_scan_cache_misses;
+
 #if CONFIG_FREERTOS_USE_TRACE_FACILITY
 static int task_status_cmp(const void *a, const void *b)
 {
@@ -157,6 +203,151 @@ static esp_err_t cgi_status_header(httpd_req_t *req)
 		uart_rx_data_relay);
 	httpd_resp_sendstr_chunk(req, buffer);
 
+	// Report GDB throughput as the delta since the last refresh of this page
+	static uint32_t last_gdb_rx_bytes;
+	static uint32_t last_gdb_tx_bytes;
+	static TickType_t last_gdb_ticks;
+	TickType_t now = xTaskGetTickCount();
+	uint32_t elapsed_ms = (now - last_gdb_ticks) * portTICK_PERIOD_MS;
+	if (elapsed_ms == 0) {
+		elapsed_ms = 1;
+	}
+	snprintf(buffer, sizeof(buffer),
+		"gdb_rx_bytes: %" PRIu32 "\n"
+		"gdb_rx_recv_calls: %" PRIu32 "\n"
+		"gdb_rx_poll_calls: %" PRIu32 "\n"
+		"gdb_rx_bytes_per_sec: %" PRIu32 "\n"
+		"gdb_tx_bytes: %" PRIu32 "\n"
+		"gdb_tx_send_calls: %" PRIu32 "\n"
+		"gdb_tx_bytes_per_sec: %" PRIu32 "\n",
+		gdb_wifi_rx_bytes, gdb_wifi_rx_calls, gdb_wifi_poll_calls,
+		(uint32_t)(((uint64_t)(gdb_wifi_rx_bytes - last_gdb_rx_bytes) * 1000) / elapsed_ms), gdb_wifi_tx_bytes,
+		gdb_wifi_tx_calls, (uint32_t)(((uint64_t)(gdb_wifi_tx_bytes - last_gdb_tx_bytes) * 1000) / elapsed_ms));
+	httpd_resp_sendstr_chunk(req, buffer);
+
+	static uint32_t last_gdb_poll_count;
+	snprintf(buffer, sizeof(buffer),
+		"gdb_poll_rate: %" PRIu32 "\n"
+		"gdb_poll_interval_ms: %" PRIu32 "\n"
+		"gdb_halt_latency_us: %" PRIu32 "\n"
+		"gdb_halt_latency_max_us: %" PRIu32 "\n"
+		"gdb_tx_rle_saved_bytes: %" PRIu32 "\n",
+		(uint32_t)(((uint64_t)(gdb_poll_count - last_gdb_poll_count) * 1000) / elapsed_ms), gdb_poll_interval_ms,
+		gdb_halt_latency_us, gdb_halt_latency_max_us, gdb_wifi_rle_saved);
+	httpd_resp_sendstr_chunk(req, buffer);
+	last_gdb_poll_count = gdb_poll_count;
+
+#if CONFIG_GDB_SERVER_MULTIPLEXED
+	// Sessions are allocated from the heap, so there is no fixed pool size
+	const int gdb_session_pool_size = 0;
+#else
+	const int gdb_session_pool_size = CONFIG_GDB_SESSION_POOL_SIZE;
+#endif
+	snprintf(buffer, sizeof(buffer),
+		"gdb_session_pool_size: %d\n"
+		"gdb_session_pool_used: %" PRIu32 "\n"
+		"gdb_session_pool_peak: %" PRIu32 "\n"
+		"gdb_session_pool_rejected: %" PRIu32 "\n",
+		gdb_session_pool_size, gdb_session_pool_used, gdb_session_pool_peak, gdb_session_pool_rejected);
+	httpd_resp_sendstr_chunk(req, buffer);
+
+	snprintf(buffer, sizeof(buffer),
+		"gdb_packet_size: %" PRIu32 "\n"
+		"gdb_load_bytes: %" PRIu32 "\n"
+		"gdb_load_time_ms: %" PRIu32 "\n"
+		"gdb_load_bytes_per_sec: %" PRIu32 "\n",
+		gdb_packet_size, gdb_load_bytes, gdb_load_time_ms, gdb_load_bytes_per_sec);
+	httpd_resp_sendstr_chunk(req, buffer);
+
+	snprintf(buffer, sizeof(buffer),
+		"gdb_memcache_hits: %" PRIu32 "\n"
+		"gdb_memcache_misses: %" PRIu32 "\n"
+		"gdb_memcache_uncached: %" PRIu32 "\n"
+		"gdb_regcache_hits: %" PRIu32 "\n"
+		"gdb_regcache_misses: %" PRIu32 "\n",
+		gdb_memcache_hits, gdb_memcache_misses, gdb_memcache_uncached, gdb_regcache_hits, gdb_regcache_misses);
+	httpd_resp_sendstr_chunk(req, buffer);
+
+	snprintf(buffer, sizeof(buffer),
+		"gdb_prefetch_lines: %" PRIu32 "\n"
+		"gdb_prefetch_hits: %" PRIu32 "\n",
+		gdb_prefetch_lines, gdb_prefetch_hits);
+	httpd_resp_sendstr_chunk(req, buffer);
+
+#if CONFIG_GDB_INCREMENTAL_FLASH
+	snprintf(buffer, sizeof(buffer),
+		"gdb_flash_blocks_written: %" PRIu32 "\n"
+		"gdb_flash_blocks_erased: %" PRIu32 "\n"
+		"gdb_flash_blocks_skipped: %" PRIu32 "\n",
+		gdb_flash_blocks_written, gdb_flash_blocks_erased, gdb_flash_blocks_skipped);
+	httpd_resp_sendstr_chunk(req, buffer);
+#endif
+
+#if CONFIG_GDB_CRC_STUB
+	snprintf(buffer, sizeof(buffer),
+		"gdb_crc_stub_runs: %" PRIu32 "\n"
+		"gdb_crc_fallbacks: %" PRIu32 "\n",
+		gdb_crc_stub_runs, gdb_crc_fallbacks);
+	httpd_resp_sendstr_chunk(req, buffer);
+#endif
+
+	snprintf(buffer, sizeof(buffer),
+		"gdb_range_step_requests: %" PRIu32 "\n"
+		"gdb_range_step_steps: %" PRIu32 "\n"
+		"gdb_range_step_us: %" PRIu32 "\n",
+		gdb_range_step_requests, gdb_range_step_steps, gdb_range_step_us);
+	httpd_resp_sendstr_chunk(req, buffer);
+
+#if CONFIG_GDB_CONDITIONAL_BREAKPOINTS
+	snprintf(buffer, sizeof(buffer),
+		"gdb_breakpoint_hits: %" PRIu32 "\n"
+		"gdb_breakpoint_reports: %" PRIu32 "\n"
+		"gdb_breakpoint_printfs: %" PRIu32 "\n",
+		gdb_breakpoint_hits, gdb_breakpoint_reports, gdb_breakpoint_printfs);
+	httpd_resp_sendstr_chunk(req, buffer);
+#endif
+
+#if CONFIG_GDB_TRACEPOINTS
+	snprintf(buffer, sizeof(buffer),
+		"gdb_trace_hits: %" PRIu32 "\n"
+		"gdb_trace_frames: %" PRIu32 "\n",
+		gdb_trace_hits, gdb_trace_frames);
+	httpd_resp_sendstr_chunk(req, buffer);
+#endif
+
+#if CONFIG_GDB_RTOS_THREADS
+	snprintf(buffer, sizeof(buffer),
+		"gdb_rtos_list_reads: %" PRIu32 "\n"
+		"gdb_rtos_replies: %" PRIu32 "\n",
+		gdb_rtos_list_reads, gdb_rtos_replies);
+	httpd_resp_sendstr_chunk(req, buffer);
+#endif
+
+#if CONFIG_GDB_NON_STOP
+	snprintf(buffer, sizeof(buffer),
+		"gdb_non_stop_resumes: %" PRIu32 "\n"
+		"gdb_non_stop_notifications: %" PRIu32 "\n",
+		gdb_non_stop_resumes, gdb_non_stop_notifications);
+	httpd_resp_sendstr_chunk(req, buffer);
+#endif
+
+	snprintf(buffer, sizeof(buffer),
+		"gdb_target_parks: %" PRIu32 "\n"
+		"gdb_target_unparks: %" PRIu32 "\n",
+		gdb_target_parks, gdb_target_unparks);
+	httpd_resp_sendstr_chunk(req, buffer);
+
+#if CONFIG_GDB_SCAN_CACHE
+	snprintf(buffer, sizeof(buffer),
+		"gdb_scan_cache_hits: %" PRIu32 "\n"
+		"gdb_scan_cache_misses: %" PRIu32 "\n",
+		gdb_scan_cache_hits, gdb_scan_cache_misses);
+	httpd_resp_sendstr_chunk(req, buffer);
+#endif
+	last_gdb_rx_bytes = gdb_wifi_rx_bytes;
+	last_gdb_tx_bytes = gdb_wifi_tx_bytes;
+	last_gdb_ticks = now;
+
 	const esp_partition_t *current_partition = esp_ota_get_running_partition();
 	const esp_partition_t *next_partition = NULL;
 	if (current_partition != NULL) {
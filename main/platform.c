@@ -491,7 +491,12 @@ void app_main(void)
 
 	uart_init();
 
+#if CONFIG_GDB_SERVER_MULTIPLEXED
+	// The server task runs the GDB sessions itself
+	xTaskCreate(&gdb_net_task, "gdb_net", 12000, NULL, 1, NULL);
+#else
 	xTaskCreate(&gdb_net_task, "gdb_net", 2000, NULL, 1, NULL);
+#endif
 
 	ESP_LOGI(TAG, "starting tftp server");
 	ota_tftp_init_server(69, 4);
@@ -5,6 +5,7 @@
 
 void uart_dbg_install(void);
 int vprintf_remote(const char *fmt, va_list va);
+void debug_putc(char c, int flush);
 void uart_init(void);
 
 #define TARGET_UART_DEV    UART1